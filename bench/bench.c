@@ -0,0 +1,712 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "future.h"
+
+/**
+ * Benchmark suite of the thread pool and the futures.
+ * Usage: bench_suite [--format csv|json] [--threads 1,2,4] [--tasks N] [--workload name]
+ * Every workload runs on a fresh pool for every thread count, which by
+ * default goes from 1 to the number of CPUs. Prints one record per run:
+ * workload,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,max_ns
+ * where the percentiles are 0 for workloads which measure throughput only.
+ *  - empty_external: empty tasks deferred from the main thread,
+ *  - empty_worker:   empty tasks deferred from inside of a pool task,
+ *  - latency:        time from defer() to the start of the task, on an idle pool,
+ *  - roundtrip:      async() followed by await() from the main thread,
+ *  - map_chain:      a chain of maps on a single async, awaited at the end,
+ *  - fanout:         a task asyncs FANOUT children and awaits all of them,
+ *  - fanout_group:   the same with the children run and waited for as a task group,
+ *  - producers:      PRODUCERS threads defer empty tasks at the same time,
+ *  - create_destroy: an empty pool is created and destroyed again,
+ *  - prio_high:      latency of high priority tasks behind FLOOD low priority ones,
+ *  - prio_flat:      the same with every task of normal priority, for comparison,
+ *  - timers:         tasks deferred with random delays of up to TIMER_SPREAD_NS at once,
+ *                    ops_per_sec counts defer_after() calls, percentiles their lateness,
+ *  - memory_unpinned: tasks each summing up MEMORY_CHUNK bytes of a buffer bigger than the caches,
+ *  - memory_pinned:   the same with every thread pinned to a CPU of its own,
+ *  - rowsum_defer:    row sums of a matrix of ROWSUM_COLUMNS columns, a defer() per cell as in macierz.c,
+ *  - rowsum_bulk:     the same with every cell deferred by a single defer_bulk(),
+ *  - rowsum_parallel: the same with a single thread_pool_parallel_for() over the cells.
+ */
+
+#define DEFAULT_TASKS 200000
+
+#define FANOUT 64
+
+#define PRODUCERS 8
+
+/* Tasks of the flood deferred ahead of each task whose latency is measured */
+#define FLOOD 100
+
+/* Time a task of the flood keeps its thread busy */
+#define FLOOD_TASK_NS 1000
+
+#define TIMER_SPREAD_NS 100000000
+
+#define MEMORY_CHUNK (256 * 1024)
+
+#define MEMORY_CHUNKS 256
+
+#define ROWSUM_COLUMNS 100
+
+typedef struct result {
+    const char *workload;
+    size_t threads;
+    size_t ops;
+    double seconds;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+} result;
+
+typedef struct workload {
+    const char *name;
+
+    void (*run)(size_t threads, result *out);
+} workload;
+
+static thread_pool_t pool;
+static size_t no_tasks;
+static atomic_size_t remaining;
+static sem_t finished;
+static uint64_t *samples;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static int compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Fills the percentiles of the result from the first n samples */
+static void percentiles(result *out, size_t n) {
+    qsort(samples, n, sizeof(uint64_t), compare);
+
+    out->p50_ns = samples[n / 2];
+    out->p99_ns = samples[n * 99 / 100];
+    out->max_ns = samples[n - 1];
+}
+
+static size_t iterations(size_t divisor) {
+    return no_tasks / divisor > 0 ? no_tasks / divisor : 1;
+}
+
+/* ========================== THROUGHPUT ============================ */
+
+static void empty_task(void *arg __attribute__((unused)), size_t argsz __attribute__((unused))) {
+    if (atomic_fetch_sub(&remaining, 1) == 1)
+        sem_post(&finished);
+}
+
+static void defer_empty(size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        defer(&pool, (runnable_t) {.function = empty_task, .arg = NULL, .argsz = 0});
+    }
+}
+
+static void spawner_task(void *arg __attribute__((unused)), size_t argsz __attribute__((unused))) {
+    defer_empty(no_tasks);
+}
+
+static void run_empty(size_t threads, result *out, int from_worker) {
+    thread_pool_init(&pool, threads);
+    atomic_store(&remaining, no_tasks);
+
+    uint64_t start = now_ns();
+
+    if (from_worker)
+        defer(&pool, (runnable_t) {.function = spawner_task, .arg = NULL, .argsz = 0});
+    else
+        defer_empty(no_tasks);
+
+    sem_wait(&finished);
+
+    out->ops = no_tasks;
+    out->seconds = (now_ns() - start) / 1e9;
+
+    thread_pool_destroy(&pool);
+}
+
+static void run_empty_external(size_t threads, result *out) {
+    run_empty(threads, out, 0);
+}
+
+static void run_empty_worker(size_t threads, result *out) {
+    run_empty(threads, out, 1);
+}
+
+static void *producer(void *arg) {
+    defer_empty((size_t) arg);
+    return NULL;
+}
+
+static void run_producers(size_t threads, result *out) {
+    pthread_t producers[PRODUCERS];
+    size_t share = no_tasks / PRODUCERS;
+
+    thread_pool_init(&pool, threads);
+    atomic_store(&remaining, share * PRODUCERS);
+
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < PRODUCERS; ++i) {
+        pthread_create(&producers[i], NULL, producer, (void *) share);
+    }
+
+    for (size_t i = 0; i < PRODUCERS; ++i) {
+        pthread_join(producers[i], NULL);
+    }
+
+    sem_wait(&finished);
+
+    out->ops = share * PRODUCERS;
+    out->seconds = (now_ns() - start) / 1e9;
+
+    thread_pool_destroy(&pool);
+}
+
+/* ============================ LATENCY ============================= */
+
+/* The argument holds the time of the submission, replaced by the latency */
+static void stamp_task(void *arg, size_t argsz __attribute__((unused))) {
+    uint64_t *sample = arg;
+    *sample = now_ns() - *sample;
+
+    sem_post(&finished);
+}
+
+static void run_latency(size_t threads, result *out) {
+    size_t n = iterations(100);
+
+    thread_pool_init(&pool, threads);
+
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < n; ++i) {
+        samples[i] = now_ns();
+        defer(&pool, (runnable_t) {.function = stamp_task, .arg = &samples[i], .argsz = sizeof(uint64_t)});
+        sem_wait(&finished);
+    }
+
+    out->ops = n;
+    out->seconds = (now_ns() - start) / 1e9;
+    percentiles(out, n);
+
+    thread_pool_destroy(&pool);
+}
+
+static void *identity(void *arg, size_t argsz __attribute__((unused)), size_t *resultSz __attribute__((unused))) {
+    return arg;
+}
+
+static void run_roundtrip(size_t threads, result *out) {
+    size_t n = iterations(100);
+
+    thread_pool_init(&pool, threads);
+
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < n; ++i) {
+        future_t future;
+        uint64_t submitted = now_ns();
+
+        async(&pool, &future, (callable_t) {.function = identity, .arg = NULL, .argsz = 0});
+        await(&future);
+
+        samples[i] = now_ns() - submitted;
+    }
+
+    out->ops = n;
+    out->seconds = (now_ns() - start) / 1e9;
+    percentiles(out, n);
+
+    thread_pool_destroy(&pool);
+}
+
+/* ========================== COMPOSITION =========================== */
+
+static void run_map_chain(size_t threads, result *out) {
+    size_t depth = iterations(10);
+    future_t *futures = malloc((depth + 1) * sizeof(future_t));
+
+    thread_pool_init(&pool, threads);
+
+    uint64_t start = now_ns();
+
+    async(&pool, &futures[0], (callable_t) {.function = identity, .arg = NULL, .argsz = 0});
+
+    for (size_t i = 0; i < depth; ++i) {
+        map(&pool, &futures[i + 1], &futures[i], identity);
+    }
+
+    await(&futures[depth]);
+
+    out->ops = depth;
+    out->seconds = (now_ns() - start) / 1e9;
+
+    thread_pool_destroy(&pool);
+    free(futures);
+}
+
+/* Fans out to FANOUT children and joins them, helping while it waits */
+static void *fanout_root(void *arg __attribute__((unused)), size_t argsz __attribute__((unused)),
+                         size_t *resultSz __attribute__((unused))) {
+    future_t children[FANOUT];
+
+    for (size_t i = 0; i < FANOUT; ++i) {
+        async(&pool, &children[i], (callable_t) {.function = identity, .arg = NULL, .argsz = 0});
+    }
+
+    for (size_t i = 0; i < FANOUT; ++i) {
+        await(&children[i]);
+    }
+
+    return NULL;
+}
+
+/* The same with a task group, a single join point for the children */
+static void *fanout_group_root(void *arg __attribute__((unused)), size_t argsz __attribute__((unused)),
+                               size_t *resultSz __attribute__((unused))) {
+    task_group_t group;
+
+    task_group_init(&group, &pool, NULL, 0);
+
+    for (size_t i = 0; i < FANOUT; ++i) {
+        task_group_run(&group, (callable_t) {.function = identity, .arg = NULL, .argsz = 0});
+    }
+
+    task_group_wait(&group);
+
+    return NULL;
+}
+
+static void run_fanout_with(size_t threads, result *out, void *(*root_function)(void *, size_t, size_t *)) {
+    size_t rounds = iterations(10 * FANOUT);
+
+    thread_pool_init(&pool, threads);
+
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < rounds; ++i) {
+        future_t root;
+        uint64_t submitted = now_ns();
+
+        async(&pool, &root, (callable_t) {.function = root_function, .arg = NULL, .argsz = 0});
+        await(&root);
+
+        samples[i] = now_ns() - submitted;
+    }
+
+    out->ops = rounds * FANOUT;
+    out->seconds = (now_ns() - start) / 1e9;
+    percentiles(out, rounds);
+
+    thread_pool_destroy(&pool);
+}
+
+static void run_fanout(size_t threads, result *out) {
+    run_fanout_with(threads, out, fanout_root);
+}
+
+static void run_fanout_group(size_t threads, result *out) {
+    run_fanout_with(threads, out, fanout_group_root);
+}
+
+/* ============================ LIFETIME ============================ */
+
+static void run_create_destroy(size_t threads, result *out) {
+    size_t cycles = iterations(1000);
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < cycles; ++i) {
+        uint64_t created = now_ns();
+
+        thread_pool_init(&pool, threads);
+        thread_pool_destroy(&pool);
+
+        samples[i] = now_ns() - created;
+    }
+
+    out->ops = cycles;
+    out->seconds = (now_ns() - start) / 1e9;
+    percentiles(out, cycles);
+}
+
+/* =========================== PRIORITIES =========================== */
+
+static void busy_task(void *arg __attribute__((unused)), size_t argsz __attribute__((unused))) {
+    uint64_t start = now_ns();
+
+    while (now_ns() - start < FLOOD_TASK_NS);
+}
+
+/* Measures the latency of probes deferred with probe_prio, each behind FLOOD tasks of flood_prio */
+static void run_prio(size_t threads, result *out, thread_pool_prio probe_prio, thread_pool_prio flood_prio) {
+    size_t n = iterations(100);
+
+    thread_pool_init(&pool, threads);
+
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < FLOOD; ++j) {
+            defer_prio(&pool, (runnable_t) {.function = busy_task, .arg = NULL, .argsz = 0}, flood_prio);
+        }
+
+        samples[i] = now_ns();
+        defer_prio(&pool, (runnable_t) {.function = stamp_task, .arg = &samples[i], .argsz = sizeof(uint64_t)},
+                   probe_prio);
+        sem_wait(&finished);
+    }
+
+    thread_pool_wait_idle(&pool);
+
+    out->ops = n;
+    out->seconds = (now_ns() - start) / 1e9;
+    percentiles(out, n);
+
+    thread_pool_destroy(&pool);
+}
+
+static void run_prio_high(size_t threads, result *out) {
+    run_prio(threads, out, THREAD_POOL_PRIO_HIGH, THREAD_POOL_PRIO_LOW);
+}
+
+static void run_prio_flat(size_t threads, result *out) {
+    run_prio(threads, out, THREAD_POOL_PRIO_NORMAL, THREAD_POOL_PRIO_NORMAL);
+}
+
+/* ============================= TIMERS ============================= */
+
+/* The argument holds the time the task is due, replaced by how late it ran */
+static void late_task(void *arg, size_t argsz __attribute__((unused))) {
+    uint64_t *sample = arg;
+    *sample = now_ns() - *sample;
+
+    if (atomic_fetch_sub(&remaining, 1) == 1)
+        sem_post(&finished);
+}
+
+static void run_timers(size_t threads, result *out) {
+    unsigned int seed = 1;
+
+    thread_pool_init(&pool, threads);
+    atomic_store(&remaining, no_tasks);
+
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < no_tasks; ++i) {
+        uint64_t delay = (uint64_t) rand_r(&seed) % TIMER_SPREAD_NS;
+
+        samples[i] = now_ns() + delay;
+        defer_after(&pool, (runnable_t) {.function = late_task, .arg = &samples[i], .argsz = sizeof(uint64_t)},
+                    delay);
+    }
+
+    out->ops = no_tasks;
+    out->seconds = (now_ns() - start) / 1e9;
+
+    sem_wait(&finished);
+    percentiles(out, no_tasks);
+
+    thread_pool_destroy(&pool);
+}
+
+/* ============================= MEMORY ============================= */
+
+static uint64_t *memory;
+
+/* Reads and writes a chunk of the buffer, chunks are picked in turns so caches do not help much */
+static void memory_task(void *arg, size_t argsz __attribute__((unused))) {
+    uint64_t *chunk = memory + ((size_t) arg % MEMORY_CHUNKS) * (MEMORY_CHUNK / sizeof(uint64_t));
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < MEMORY_CHUNK / sizeof(uint64_t); ++i) {
+        sum += chunk[i];
+        chunk[i] = sum;
+    }
+
+    if (atomic_fetch_sub(&remaining, 1) == 1)
+        sem_post(&finished);
+}
+
+static void run_memory(size_t threads, result *out, thread_pool_pin pin) {
+    size_t n = iterations(100);
+    thread_pool_options_t options;
+
+    thread_pool_options_init(&options, threads);
+    options.pin = pin;
+    thread_pool_init_ex(&pool, &options);
+
+    memory = calloc(MEMORY_CHUNKS, MEMORY_CHUNK);
+    atomic_store(&remaining, n);
+
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < n; ++i) {
+        defer(&pool, (runnable_t) {.function = memory_task, .arg = (void *) i, .argsz = 0});
+    }
+
+    sem_wait(&finished);
+
+    out->ops = n;
+    out->seconds = (now_ns() - start) / 1e9;
+
+    thread_pool_destroy(&pool);
+    free(memory);
+}
+
+static void run_memory_unpinned(size_t threads, result *out) {
+    run_memory(threads, out, THREAD_POOL_PIN_NONE);
+}
+
+static void run_memory_pinned(size_t threads, result *out) {
+    run_memory(threads, out, THREAD_POOL_PIN_CPU);
+}
+
+/* ============================= ROWSUM ============================= */
+
+typedef enum rowsum_mode {
+    ROWSUM_DEFER,
+    ROWSUM_BULK,
+    ROWSUM_PARALLEL
+} rowsum_mode;
+
+static int *cells;
+static atomic_long *row_sums;
+
+static void rowsum_cell(void *arg, size_t argsz __attribute__((unused))) {
+    size_t cell = (size_t) arg;
+
+    atomic_fetch_add_explicit(&row_sums[cell / ROWSUM_COLUMNS], cells[cell], memory_order_relaxed);
+
+    if (atomic_fetch_sub(&remaining, 1) == 1)
+        sem_post(&finished);
+}
+
+/* Sums up the cells of each row of the chunk first, so a row costs one atomic add */
+static void rowsum_chunk(size_t begin, size_t end, void *ctx __attribute__((unused))) {
+    while (begin < end) {
+        size_t row = begin / ROWSUM_COLUMNS;
+        size_t stop = (row + 1) * ROWSUM_COLUMNS < end ? (row + 1) * ROWSUM_COLUMNS : end;
+        long sum = 0;
+
+        for (; begin < stop; ++begin) {
+            sum += cells[begin];
+        }
+
+        atomic_fetch_add_explicit(&row_sums[row], sum, memory_order_relaxed);
+    }
+}
+
+static void run_rowsum(size_t threads, result *out, rowsum_mode mode) {
+    size_t n = iterations(1);
+    size_t rows = (n + ROWSUM_COLUMNS - 1) / ROWSUM_COLUMNS;
+
+    thread_pool_init(&pool, threads);
+
+    cells = malloc(n * sizeof(int));
+    row_sums = calloc(rows, sizeof(atomic_long));
+
+    for (size_t i = 0; i < n; ++i) {
+        cells[i] = (int) (i % 7);
+    }
+
+    /* The runnables of defer_bulk() are built before the clock starts, as macierz.c reads them first */
+    runnable_t *runnables = mode == ROWSUM_BULK ? malloc(n * sizeof(runnable_t)) : NULL;
+
+    for (size_t i = 0; runnables != NULL && i < n; ++i) {
+        runnables[i] = (runnable_t) {.function = rowsum_cell, .arg = (void *) i, .argsz = 0};
+    }
+
+    atomic_store(&remaining, n);
+
+    uint64_t start = now_ns();
+
+    if (mode == ROWSUM_PARALLEL) {
+        thread_pool_parallel_for(&pool, 0, n, 0, rowsum_chunk, NULL);
+    } else {
+        if (mode == ROWSUM_BULK) {
+            defer_bulk(&pool, runnables, n);
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                defer(&pool, (runnable_t) {.function = rowsum_cell, .arg = (void *) i, .argsz = 0});
+            }
+        }
+
+        sem_wait(&finished);
+    }
+
+    out->ops = n;
+    out->seconds = (now_ns() - start) / 1e9;
+
+    thread_pool_destroy(&pool);
+    free(runnables);
+    free(cells);
+    free(row_sums);
+}
+
+static void run_rowsum_defer(size_t threads, result *out) {
+    run_rowsum(threads, out, ROWSUM_DEFER);
+}
+
+static void run_rowsum_bulk(size_t threads, result *out) {
+    run_rowsum(threads, out, ROWSUM_BULK);
+}
+
+static void run_rowsum_parallel(size_t threads, result *out) {
+    run_rowsum(threads, out, ROWSUM_PARALLEL);
+}
+
+/* ================================================================== */
+
+static const workload workloads[] = {
+        {"empty_external",  run_empty_external},
+        {"empty_worker",    run_empty_worker},
+        {"latency",         run_latency},
+        {"roundtrip",       run_roundtrip},
+        {"map_chain",       run_map_chain},
+        {"fanout",          run_fanout},
+        {"fanout_group",    run_fanout_group},
+        {"producers",       run_producers},
+        {"create_destroy",  run_create_destroy},
+        {"prio_high",       run_prio_high},
+        {"prio_flat",       run_prio_flat},
+        {"timers",          run_timers},
+        {"memory_unpinned", run_memory_unpinned},
+        {"memory_pinned",   run_memory_pinned},
+        {"rowsum_defer",    run_rowsum_defer},
+        {"rowsum_bulk",     run_rowsum_bulk},
+        {"rowsum_parallel", run_rowsum_parallel},
+};
+
+#define NO_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static void print_result(const result *r, int json, int first) {
+    double ops_per_sec = r->seconds > 0 ? r->ops / r->seconds : 0;
+
+    if (json) {
+        printf("%s  {\"workload\": \"%s\", \"threads\": %zu, \"ops\": %zu, \"seconds\": %.6f, "
+               "\"ops_per_sec\": %.0f, \"p50_ns\": %lu, \"p99_ns\": %lu, \"max_ns\": %lu}",
+               first ? "" : ",\n", r->workload, r->threads, r->ops, r->seconds, ops_per_sec,
+               (unsigned long) r->p50_ns, (unsigned long) r->p99_ns, (unsigned long) r->max_ns);
+    } else {
+        printf("%s,%zu,%zu,%.6f,%.0f,%lu,%lu,%lu\n", r->workload, r->threads, r->ops, r->seconds,
+               ops_per_sec, (unsigned long) r->p50_ns, (unsigned long) r->p99_ns, (unsigned long) r->max_ns);
+    }
+
+    fflush(stdout);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [--format csv|json] [--threads 1,2,4] [--tasks N] [--workload name]\n", name);
+    fprintf(stderr, "Workloads:");
+
+    for (size_t i = 0; i < NO_WORKLOADS; ++i) {
+        fprintf(stderr, " %s", workloads[i].name);
+    }
+
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+    int json = 0;
+    const char *only = NULL;
+    size_t thread_counts[64];
+    size_t no_counts = 0;
+
+    no_tasks = DEFAULT_TASKS;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            json = strcmp(argv[++i], "json") == 0;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            for (char *p = argv[++i]; *p != '\0' && no_counts < 64; p += *p == ',') {
+                thread_counts[no_counts++] = strtoul(p, &p, 10);
+            }
+        } else if (strcmp(argv[i], "--tasks") == 0 && i + 1 < argc) {
+            no_tasks = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--workload") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (no_counts == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+        for (long threads = 1; threads <= cores && no_counts < 64; ++threads) {
+            thread_counts[no_counts++] = threads;
+        }
+    }
+
+    for (size_t t = 0; t < no_counts; ++t) {
+        if (thread_counts[t] == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int known = only == NULL;
+
+    for (size_t w = 0; w < NO_WORKLOADS; ++w) {
+        known |= only != NULL && strcmp(only, workloads[w].name) == 0;
+    }
+
+    if (!known) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (no_tasks < PRODUCERS) {
+        fprintf(stderr, "%s: --tasks must be at least %d\n", argv[0], PRODUCERS);
+        return 1;
+    }
+
+    samples = malloc(no_tasks * sizeof(uint64_t));
+    sem_init(&finished, 0, 0);
+
+    int first = 1;
+
+    if (json)
+        printf("[\n");
+    else
+        printf("workload,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,max_ns\n");
+
+    for (size_t w = 0; w < NO_WORKLOADS; ++w) {
+        if (only != NULL && strcmp(only, workloads[w].name) != 0)
+            continue;
+
+        for (size_t t = 0; t < no_counts; ++t) {
+            result r = {.workload = workloads[w].name, .threads = thread_counts[t]};
+
+            workloads[w].run(thread_counts[t], &r);
+            print_result(&r, json, first);
+            first = 0;
+        }
+    }
+
+    if (json)
+        printf("\n]\n");
+
+    sem_destroy(&finished);
+    free(samples);
+
+    return 0;
+}
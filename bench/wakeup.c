@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+
+/**
+ * Measures how fast an idle worker picks up a task and how many context
+ * switches the workers do per task, for the pool (eventcount parking)
+ * and for a copy of the binary semaphore scheme it used before,
+ * which broadcast to every idle worker on every push.
+ * Usage: bench_wakeup [threads] [tasks] [gap_us]
+ * Prints CSV: scheme,threads,tasks,p50_us,p99_us,max_us,ctx_switches_per_task
+ */
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_TASKS 2000
+#define DEFAULT_GAP_US 200
+
+static uint64_t *submitted;
+static uint64_t *latency;
+static atomic_size_t remaining;
+static sem_t finished;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static long ctx_switches(int who) {
+    struct rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+static void timed_task(void *arg, size_t argsz __attribute__((unused))) {
+    size_t i = (uintptr_t) arg;
+    latency[i] = now_ns() - submitted[i];
+
+    if (atomic_fetch_sub(&remaining, 1) == 1)
+        sem_post(&finished);
+}
+
+/* ======================= LEGACY BSEM SCHEME ======================= */
+
+typedef struct legacy_job {
+    struct legacy_job *prev;
+    runnable_t job;
+} legacy_job;
+
+typedef struct legacy_bsem {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t v;
+} legacy_bsem;
+
+typedef struct legacy_pool {
+    pthread_mutex_t r_w_mutex;
+    legacy_job *front;
+    legacy_job *rear;
+    size_t len;
+    legacy_bsem has_jobs;
+    volatile int keep_alive;
+    pthread_t *threads;
+    size_t num_threads;
+} legacy_pool;
+
+static void bsem_wait(legacy_bsem *bsem_p) {
+    pthread_mutex_lock(&bsem_p->mutex);
+
+    while (bsem_p->v != 1) {
+        pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
+    }
+
+    bsem_p->v = 0;
+    pthread_mutex_unlock(&bsem_p->mutex);
+}
+
+static void bsem_post(legacy_bsem *bsem_p, int all) {
+    pthread_mutex_lock(&bsem_p->mutex);
+    bsem_p->v = 1;
+
+    if (all)
+        pthread_cond_broadcast(&bsem_p->cond);
+    else
+        pthread_cond_signal(&bsem_p->cond);
+
+    pthread_mutex_unlock(&bsem_p->mutex);
+}
+
+static void legacy_push(legacy_pool *pool, runnable_t runnable) {
+    legacy_job *job_p = malloc(sizeof(legacy_job));
+    job_p->prev = NULL;
+    job_p->job = runnable;
+
+    pthread_mutex_lock(&pool->r_w_mutex);
+
+    if (pool->len == 0)
+        pool->front = job_p;
+    else
+        pool->rear->prev = job_p;
+
+    pool->rear = job_p;
+    pool->len += 1;
+
+    bsem_post(&pool->has_jobs, 1);
+    pthread_mutex_unlock(&pool->r_w_mutex);
+}
+
+static legacy_job *legacy_pull(legacy_pool *pool) {
+    pthread_mutex_lock(&pool->r_w_mutex);
+
+    legacy_job *job_p = pool->front;
+
+    if (pool->len == 1) {
+        pool->front = NULL;
+        pool->rear = NULL;
+        pool->len = 0;
+    } else if (pool->len > 1) {
+        pool->front = job_p->prev;
+        pool->len -= 1;
+        bsem_post(&pool->has_jobs, 0);
+    }
+
+    pthread_mutex_unlock(&pool->r_w_mutex);
+
+    return job_p;
+}
+
+static void *legacy_thread_do(void *arg) {
+    legacy_pool *pool = arg;
+
+    while (pool->keep_alive) {
+        bsem_wait(&pool->has_jobs);
+
+        if (!pool->keep_alive) {
+            /* Pass the wake-up on to the next thread to end */
+            bsem_post(&pool->has_jobs, 1);
+            break;
+        }
+
+        legacy_job *job_p = legacy_pull(pool);
+
+        if (job_p != NULL) {
+            job_p->job.function(job_p->job.arg, job_p->job.argsz);
+            free(job_p);
+        }
+    }
+
+    return NULL;
+}
+
+static void legacy_init(legacy_pool *pool, size_t num_threads) {
+    pthread_mutex_init(&pool->r_w_mutex, NULL);
+    pthread_mutex_init(&pool->has_jobs.mutex, NULL);
+    pthread_cond_init(&pool->has_jobs.cond, NULL);
+    pool->has_jobs.v = 0;
+    pool->front = NULL;
+    pool->rear = NULL;
+    pool->len = 0;
+    pool->keep_alive = 1;
+    pool->num_threads = num_threads;
+    pool->threads = malloc(num_threads * sizeof(pthread_t));
+
+    for (size_t i = 0; i < num_threads; ++i) {
+        pthread_create(&pool->threads[i], NULL, legacy_thread_do, pool);
+    }
+}
+
+static void legacy_destroy(legacy_pool *pool) {
+    pool->keep_alive = 0;
+    bsem_post(&pool->has_jobs, 1);
+
+    for (size_t i = 0; i < pool->num_threads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    free(pool->threads);
+}
+
+/* ================================================================== */
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *scheme, size_t threads, size_t tasks, long switches) {
+    qsort(latency, tasks, sizeof(uint64_t), cmp_u64);
+
+    printf("%s,%zu,%zu,%.2f,%.2f,%.2f,%.2f\n", scheme, threads, tasks,
+           latency[tasks / 2] / 1e3, latency[tasks * 99 / 100] / 1e3, latency[tasks - 1] / 1e3,
+           (double) switches / tasks);
+}
+
+int main(int argc, char **argv) {
+    size_t threads = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_THREADS;
+    size_t tasks = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_TASKS;
+    useconds_t gap = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_GAP_US;
+
+    submitted = malloc(tasks * sizeof(uint64_t));
+    latency = malloc(tasks * sizeof(uint64_t));
+    sem_init(&finished, 0, 0);
+
+    printf("scheme,threads,tasks,p50_us,p99_us,max_us,ctx_switches_per_task\n");
+
+    for (int scheme = 0; scheme < 2; ++scheme) {
+        thread_pool_t pool;
+        legacy_pool legacy;
+
+        if (scheme == 0)
+            legacy_init(&legacy, threads);
+        else
+            thread_pool_init(&pool, threads);
+
+        /* Let every worker fall asleep */
+        usleep(10000);
+        atomic_store(&remaining, tasks);
+
+        /* Switches of the submitting thread are the same for both schemes */
+        long before = ctx_switches(RUSAGE_SELF) - ctx_switches(RUSAGE_THREAD);
+
+        for (size_t i = 0; i < tasks; ++i) {
+            runnable_t runnable = {.function = timed_task, .arg = (void *) (uintptr_t) i, .argsz = 0};
+            submitted[i] = now_ns();
+
+            if (scheme == 0)
+                legacy_push(&legacy, runnable);
+            else
+                defer(&pool, runnable);
+
+            usleep(gap);
+        }
+
+        sem_wait(&finished);
+        long after = ctx_switches(RUSAGE_SELF) - ctx_switches(RUSAGE_THREAD);
+
+        if (scheme == 0)
+            legacy_destroy(&legacy);
+        else
+            thread_pool_destroy(&pool);
+
+        report(scheme == 0 ? "bsem" : "park", threads, tasks, after - before);
+    }
+
+    sem_destroy(&finished);
+    free(submitted);
+    free(latency);
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "deque.h"
+
+/*
+ * Memory orderings follow "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013).
+ */
+
+static deque_array *deque_array_new(size_t size) {
+    deque_array *array = malloc(sizeof(deque_array) + size * sizeof(_Atomic(void *)));
+
+    if (array == NULL)
+        return NULL;
+
+    array->size = size;
+    array->prev = NULL;
+
+    return array;
+}
+
+/**
+ * Replaces the array of the deque with one twice as big.
+ * The old array is kept until the deque is destroyed,
+ * as a thief may still be reading from it.
+ */
+static deque_array *deque_grow(deque *deque_p, deque_array *old, ssize_t top, ssize_t bottom) {
+    deque_array *array = deque_array_new(old->size * 2);
+
+    if (array == NULL)
+        return NULL;
+
+    for (ssize_t i = top; i < bottom; ++i) {
+        void *item = atomic_load_explicit(&old->buf[i & (old->size - 1)], memory_order_relaxed);
+        atomic_store_explicit(&array->buf[i & (array->size - 1)], item, memory_order_relaxed);
+    }
+
+    array->prev = old;
+    atomic_store_explicit(&deque_p->array, array, memory_order_release);
+
+    return array;
+}
+
+/**
+ * Initializes an empty deque.
+ * @param deque_p - pointer to the deque.
+ * @return 0 on success, otherwise -1.
+ */
+int deque_init(deque *deque_p) {
+    deque_array *array = deque_array_new(DEQUE_INIT_CAPACITY);
+
+    if (array == NULL) {
+        fprintf(stderr, "deque_init(): Malloc failed for deque array.\n");
+        return -1;
+    }
+
+    atomic_init(&deque_p->top, 0);
+    atomic_init(&deque_p->bottom, 0);
+    atomic_init(&deque_p->array, array);
+
+    return 0;
+}
+
+/* Frees the arrays of the deque, not the items left in it */
+void deque_destroy(deque *deque_p) {
+    deque_array *array = atomic_load_explicit(&deque_p->array, memory_order_relaxed);
+
+    while (array != NULL) {
+        deque_array *prev = array->prev;
+        free(array);
+        array = prev;
+    }
+}
+
+/**
+ * Pushes an item at the bottom of the deque. Owner only.
+ * @return 0 on success, -1 if the deque could not grow.
+ */
+int deque_push(deque *deque_p, void *item) {
+    ssize_t bottom = atomic_load_explicit(&deque_p->bottom, memory_order_relaxed);
+    ssize_t top = atomic_load_explicit(&deque_p->top, memory_order_acquire);
+    deque_array *array = atomic_load_explicit(&deque_p->array, memory_order_relaxed);
+
+    if (bottom - top > (ssize_t) array->size - 1) {
+        array = deque_grow(deque_p, array, top, bottom);
+
+        if (array == NULL) {
+            fprintf(stderr, "deque_push(): Malloc failed for growing deque.\n");
+            return -1;
+        }
+    }
+
+    atomic_store_explicit(&array->buf[bottom & (array->size - 1)], item, memory_order_relaxed);
+
+    /* Release store rather than fence and relaxed store, same cost and visible to race detectors */
+    atomic_store_explicit(&deque_p->bottom, bottom + 1, memory_order_release);
+
+    return 0;
+}
+
+/**
+ * Pushes n items at the bottom of the deque, publishing them at once. Owner only.
+ * @return 0 on success, -1 if the deque could not grow.
+ */
+int deque_push_bulk(deque *deque_p, void **items, size_t n) {
+    ssize_t bottom = atomic_load_explicit(&deque_p->bottom, memory_order_relaxed);
+    ssize_t top = atomic_load_explicit(&deque_p->top, memory_order_acquire);
+    deque_array *array = atomic_load_explicit(&deque_p->array, memory_order_relaxed);
+
+    while (bottom - top + (ssize_t) n > (ssize_t) array->size) {
+        array = deque_grow(deque_p, array, top, bottom);
+
+        if (array == NULL) {
+            fprintf(stderr, "deque_push_bulk(): Malloc failed for growing deque.\n");
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        atomic_store_explicit(&array->buf[(bottom + (ssize_t) i) & (array->size - 1)], items[i],
+                              memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&deque_p->bottom, bottom + (ssize_t) n, memory_order_release);
+
+    return 0;
+}
+
+/**
+ * Pops the most recently pushed item. Owner only.
+ * @return the item, or NULL if the deque is empty.
+ */
+void *deque_pop(deque *deque_p) {
+    ssize_t bottom = atomic_load_explicit(&deque_p->bottom, memory_order_relaxed) - 1;
+    deque_array *array = atomic_load_explicit(&deque_p->array, memory_order_relaxed);
+
+    atomic_store_explicit(&deque_p->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    ssize_t top = atomic_load_explicit(&deque_p->top, memory_order_relaxed);
+    void *item = NULL;
+
+    if (top <= bottom) {
+        item = atomic_load_explicit(&array->buf[bottom & (array->size - 1)], memory_order_relaxed);
+
+        if (top == bottom) {
+            /* Last item, race against thieves for it */
+            if (!atomic_compare_exchange_strong_explicit(&deque_p->top, &top, top + 1,
+                                                         memory_order_seq_cst, memory_order_relaxed)) {
+                item = NULL;
+            }
+
+            atomic_store_explicit(&deque_p->bottom, bottom + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&deque_p->bottom, bottom + 1, memory_order_relaxed);
+    }
+
+    return item;
+}
+
+/**
+ * Steals the oldest item of the deque. Any thread.
+ * @param deque_p - pointer to the deque.
+ * @param item    - set to the stolen item on DEQUE_OK.
+ * @return DEQUE_OK, DEQUE_EMPTY or DEQUE_ABORT if the race was lost.
+ */
+deque_status deque_steal(deque *deque_p, void **item) {
+    ssize_t top = atomic_load_explicit(&deque_p->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    ssize_t bottom = atomic_load_explicit(&deque_p->bottom, memory_order_acquire);
+
+    if (top >= bottom)
+        return DEQUE_EMPTY;
+
+    deque_array *array = atomic_load_explicit(&deque_p->array, memory_order_acquire);
+    void *stolen = atomic_load_explicit(&array->buf[top & (array->size - 1)], memory_order_relaxed);
+
+    if (!atomic_compare_exchange_strong_explicit(&deque_p->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return DEQUE_ABORT;
+    }
+
+    *item = stolen;
+
+    return DEQUE_OK;
+}
+
+/* Approximate number of items, exact only when called by the owner with no thieves around */
+size_t deque_size(deque *deque_p) {
+    ssize_t bottom = atomic_load_explicit(&deque_p->bottom, memory_order_relaxed);
+    ssize_t top = atomic_load_explicit(&deque_p->top, memory_order_relaxed);
+
+    return bottom > top ? (size_t) (bottom - top) : 0;
+}
@@ -0,0 +1,49 @@
+#ifndef ASYNC_DEQUE_H
+#define ASYNC_DEQUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "platform.h"
+
+/**
+ * Chase-Lev work-stealing deque of pointers.
+ * Only the owner thread may push and pop (at the bottom),
+ * any thread may steal (from the top).
+ */
+
+#define DEQUE_INIT_CAPACITY 256
+
+typedef enum deque_status {
+    DEQUE_OK,    /* Element was taken */
+    DEQUE_EMPTY, /* Deque was empty */
+    DEQUE_ABORT  /* Lost a race with another thief or the owner, may retry */
+} deque_status;
+
+typedef struct deque_array {
+    size_t size;              /* Capacity, always a power of two */
+    struct deque_array *prev; /* Smaller array replaced by this one */
+    _Atomic(void *) buf[];
+} deque_array;
+
+typedef struct deque {
+    CACHE_ALIGNED _Atomic ssize_t top;    /* Written by thieves */
+    CACHE_ALIGNED _Atomic ssize_t bottom; /* Written by the owner only */
+    _Atomic(deque_array *) array;
+} deque;
+
+int deque_init(deque *deque_p);
+
+void deque_destroy(deque *deque_p);
+
+int deque_push(deque *deque_p, void *item);
+
+int deque_push_bulk(deque *deque_p, void **items, size_t n);
+
+void *deque_pop(deque *deque_p);
+
+deque_status deque_steal(deque *deque_p, void **item);
+
+size_t deque_size(deque *deque_p);
+
+#endif //ASYNC_DEQUE_H
@@ -1,7 +1,11 @@
 #include <pthread.h>
+#include <sched.h>
 #include "future.h"
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 typedef void *(*function_t)(void *, size_t, size_t *);
 
@@ -9,6 +13,8 @@ int future_init(future_t *future);
 
 void future_set(future_t *future, void *result, size_t resultSz);
 
+static void future_complete(future_t *future, void *result, size_t resultSz, uint32_t done);
+
 void *future_get(future_t *future);
 
 void future_destroy(future_t *future);
@@ -16,19 +22,65 @@ void future_destroy(future_t *future);
 typedef struct wrap {
     callable_t callable;
     future_t *future;
-    runnable_t *runnable;
+    thread_pool_t *pool; /* Recycles the wrapper */
+    shared_future_t *shared; /* Reference released once the future is set, NULL for a plain one */
+    _Alignas(max_align_t) unsigned char args[THREAD_POOL_INLINE_ARG_SIZE]; /* Copy of a small argument */
 } wrap_t;
 
 typedef struct map_wrap {
     future_t *future_from;
     function_t func;
     future_t *new_future;
-    runnable_t *runnable;
+    thread_pool_t *pool;
+    struct when *when;     /* Combinator the wrapper is an arm of, NULL for a map */
+    shared_future_t *shared; /* Reference to future_from released once mapped, NULL for a plain one */
+    struct map_wrap *next; /* Next continuation of future_from */
 } map_wrap_t;
 
+/* Shared by the arms of when_all() and when_any(), freed by the last of them */
+typedef struct when {
+    atomic_size_t remaining; /* Arms not done yet, plus one for the registering thread */
+    atomic_bool won;         /* when_any(): out was set by the first arm done */
+    bool all;                /* when_all(), otherwise when_any() */
+    future_t *out;
+    future_t *futures;
+    void **results;          /* when_all(): result of out, filled by the last arm */
+    size_t n;
+    thread_pool_t *pool;     /* Recycles the state */
+    map_wrap_t arms[];
+} when_t;
+
+/* States of a future, FUTURE_WAITERS is set only while pending */
+#define FUTURE_PENDING 0u
+#define FUTURE_READY 1u
+#define FUTURE_WAITERS 2u
+#define FUTURE_CANCELLED 4u /* Set with FUTURE_READY when the future has no result */
+
+/* A pool thread with nothing to help with sleeps this long at first, then twice as long up to the max */
+#define FUTURE_HELP_MIN_WAIT_NS 10000L
+#define FUTURE_HELP_MAX_WAIT_NS 1000000L
+
+/* Marks the list of continuations of a done future, no more can be added */
+#define FUTURE_CLOSED ((map_wrap_t *) 1)
+
+static int map_schedule(map_wrap_t *wrapper);
+
+static void future_settle(future_t *future);
+
+static void future_cancel(future_t *future);
+
+static void when_arm_done(when_t *when, map_wrap_t *arm);
+
+static int async_submit(thread_pool_t *pool, future_t *future, callable_t callable,
+                        thread_pool_prio prio, shared_future_t *shared);
+
+static int map_register(thread_pool_t *pool, future_t *future, future_t *from,
+                        function_t function, shared_future_t *shared);
+
 /**
  * The function is used as a runnable function in map function
  * to create a new value for a future from another future.
+ * It is only scheduled once the future it maps from is done.
  * @param arg   - argument of the runnable;
  * @param argsz - size of the argument of runnable.
  */
@@ -37,21 +89,33 @@ void map_runnable(void *arg, size_t argsz __attribute__ ((unused))) {
 
     future_t *fut = wrapper->future_from;
 
-    /* Thread may stop here to wait until future_value is done. */
-    void *futResult = future_get(fut);
-    /* When future_value is done its size is also set. */
+    future_settle(fut);
+
+    void *futResult = fut->result;
     size_t futResultSz = fut->resultSz;
+    bool cancelled = future_is_cancelled(fut);
 
     function_t func = wrapper->func;
-
+    void *result = NULL;
     size_t resultSz = 0;
-    void *result = func(futResult, futResultSz, &resultSz);
-    future_set(wrapper->new_future, result, resultSz);
 
-    /* Destroys the mutex and condition in the future but not the result of it. */
-    future_destroy(fut);
-    free(wrapper->runnable);
-    free(wrapper);
+    /* A map of a cancelled future is cancelled without calling func */
+    if (!cancelled)
+        result = func(futResult, futResultSz, &resultSz);
+
+    /* Ends the future but not its result, a shared one may be freed with the last reference.
+     * Once new_future is done, whoever awaits it may let fut go, so this comes first. */
+    if (wrapper->shared != NULL)
+        shared_future_release(wrapper->shared);
+    else
+        future_destroy(fut);
+
+    if (cancelled)
+        future_cancel(wrapper->new_future);
+    else
+        future_set(wrapper->new_future, result, resultSz);
+
+    thread_pool_free(wrapper->pool, wrapper, sizeof(map_wrap_t));
 }
 
 /**
@@ -65,34 +129,89 @@ void runnable_function(void *arg, size_t argsz __attribute__ ((unused))) {
     wrap_t *wrapper = arg;
     size_t result_size = 0;
 
-    void *(*callFunc)(void *, size_t, size_t *) = wrapper->callable.function;
-    void *result = callFunc(wrapper->callable.arg, wrapper->callable.argsz, &result_size);
+    /* Taken from the queue after its token was cancelled, the callable is not called */
+    if (cancel_token_is_cancelled(wrapper->callable.token)) {
+        future_complete(wrapper->future, NULL, 0, FUTURE_READY | FUTURE_CANCELLED);
+    } else {
+        void *(*callFunc)(void *, size_t, size_t *) = wrapper->callable.function;
+        void *result = callFunc(wrapper->callable.arg, wrapper->callable.argsz, &result_size);
 
-    future_set(wrapper->future, result, result_size);
+        future_set(wrapper->future, result, result_size);
+    }
+
+    if (wrapper->shared != NULL)
+        shared_future_release(wrapper->shared);
+
+    thread_pool_free(wrapper->pool, wrapper, sizeof(wrap_t));
+}
+
+/**
+ * Fills the wrapper of a callable. In inline_args mode of the pool,
+ * a small argument of the callable is copied into the wrapper.
+ */
+static void wrap_init(thread_pool_t *pool, wrap_t *wrapper, future_t *future, callable_t callable) {
+    wrapper->callable = callable;
+    wrapper->future = future;
+    wrapper->pool = pool;
+    wrapper->shared = NULL;
 
-    free(wrapper->runnable);
-    free(wrapper);
+    if (pool->options.inline_args && callable.arg != NULL &&
+        callable.argsz > 0 && callable.argsz <= THREAD_POOL_INLINE_ARG_SIZE) {
+        memcpy(wrapper->args, callable.arg, callable.argsz);
+        wrapper->callable.arg = wrapper->args;
+    }
 }
 
 /**
  * Function creates a new runnable out of a wrapper struct.
+ * The runnable is returned by value, as defer() copies it anyway.
+ * Its argsz is 0, as the wrapper is owned by the task and must not be copied.
  * @param wrapper - pointer to a wrapper struct.
- * @return - returns a pointer to a new runnable, otherwise null.
+ * @return - returns the new runnable.
  */
-runnable_t *callable_to_runnable(wrap_t *wrapper) {
+runnable_t callable_to_runnable(wrap_t *wrapper) {
+    runnable_t new_runnable = {
+            .function = runnable_function,
+            .arg = wrapper,
+            .argsz = 0
+    };
 
-    runnable_t *new_runnable = malloc(sizeof(runnable_t));
+    return new_runnable;
+}
 
-    if (new_runnable == NULL) {
-        err("callable_to_runnable(): malloc failed for runnable.\n");
-        return NULL;
+/* Submits the callable for the future, whose task holds the reference shared to it, if any */
+static int async_submit(thread_pool_t *pool, future_t *future, callable_t callable,
+                        thread_pool_prio prio, shared_future_t *shared) {
+    if (future_init(future) == -1) {
+        err("async(): future_init() failed as future is NULL.\n");
+        return -1;
+    }
+
+    if (pool == NULL) {
+        err("async(): async is called on null pointer.\n");
+        future_cancel(future);
+        return -1;
     }
 
-    new_runnable->function = runnable_function;
-    new_runnable->arg = wrapper;
-    new_runnable->argsz = sizeof(wrap_t);
+    wrap_t *wrapper = thread_pool_alloc(pool, sizeof(wrap_t));
 
-    return new_runnable;
+    if (wrapper == NULL) {
+        err("async(): malloc failed for creating wrapper.\n");
+        future_cancel(future);
+        return -1;
+    }
+
+    wrap_init(pool, wrapper, future, callable);
+    wrapper->shared = shared;
+
+    if (defer_prio(pool, callable_to_runnable(wrapper), prio) != 0) {
+        err("async(): Submitting new callable task failed.\n");
+        thread_pool_free(pool, wrapper, sizeof(wrap_t));
+        future_cancel(future);
+        return -1;
+    }
+
+    return 0;
 }
 
 /**
@@ -104,35 +223,158 @@ runnable_t *callable_to_runnable(wrap_t *wrapper) {
  * @return 0 on success, otherwise -1 if some failures happened.
  */
 int async(thread_pool_t *pool, future_t *future, callable_t callable) {
-    if (future_init(future) == -1) {
-        err("async(): future_init() failed as future is NULL.\n");
+    return async_prio(pool, future, callable, THREAD_POOL_PRIO_NORMAL);
+}
+
+/**
+ * As async(), but the task is deferred with the given priority, see defer_prio().
+ * Maps of the future are scheduled with normal priority.
+ * @param pool     - pointer on the thread_pool
+ * @param future   - pointer on the future which carries the result of the callable task.
+ * @param callable - callable task to be submitted to thread_pool.
+ * @param prio     - priority level of the task.
+ * @return 0 on success, otherwise -1 if some failures happened.
+ */
+int async_prio(thread_pool_t *pool, future_t *future, callable_t callable, thread_pool_prio prio) {
+    return async_submit(pool, future, callable, prio, NULL);
+}
+
+/* Leaves the n futures of a failed async_bulk() done as cancelled, initialised or not */
+static void futures_cancel(future_t *futures, size_t n) {
+    if (futures == NULL)
+        return;
+
+    for (size_t i = 0; i < n; ++i) {
+        future_init(&futures[i]);
+        future_cancel(&futures[i]);
+    }
+}
+
+/**
+ * Submits n callables to thread_pool jobqueue at once, see defer_bulk().
+ * Result of the i-th callable is set in the i-th future. On failure none
+ * of the callables is submitted and every future is done as cancelled.
+ * @param pool      - pointer on the thread_pool
+ * @param futures   - array of n futures which carry the results.
+ * @param callables - array of n callable tasks to be submitted to thread_pool.
+ * @param n         - number of the callables.
+ * @return 0 on success, otherwise -1 if some failures happened.
+ */
+int async_bulk(thread_pool_t *pool, future_t *futures, callable_t *callables, size_t n) {
+    if (pool == NULL) {
+        err("async_bulk(): async_bulk is called on null pointer.\n");
+        futures_cancel(futures, n);
         return -1;
     }
 
-    wrap_t *wrapper = malloc(sizeof(wrap_t));
+    runnable_t *runnables = malloc(n * sizeof(runnable_t));
 
-    if (wrapper == NULL) {
-        err("async(): malloc failed for creating wrapper.\n");
+    if (runnables == NULL) {
+        err("async_bulk(): malloc failed for creating runnables.\n");
+        futures_cancel(futures, n);
         return -1;
     }
 
-    wrapper->callable = callable;
-    wrapper->future = future;
-    wrapper->runnable = NULL;
+    for (size_t i = 0; i < n; ++i) {
+        wrap_t *wrapper = NULL;
+
+        if (future_init(&futures[i]) == -1 || (wrapper = thread_pool_alloc(pool, sizeof(wrap_t))) == NULL) {
+            err("async_bulk(): creating wrapper failed.\n");
 
-    runnable_t *my_runnable = callable_to_runnable(wrapper);
+            while (i > 0)
+                thread_pool_free(pool, runnables[--i].arg, sizeof(wrap_t));
 
-    if (my_runnable == NULL) {
-        err("async(): malloc failed for creating new runnable.\n");
+            free(runnables);
+            futures_cancel(futures, n);
+            return -1;
+        }
+
+        wrap_init(pool, wrapper, &futures[i], callables[i]);
+
+        runnables[i] = callable_to_runnable(wrapper);
+    }
+
+    /* A failed batch queued none of the wrappers, see defer_bulk() */
+    if (defer_bulk(pool, runnables, n) != 0) {
+        err("async_bulk(): Submitting new callable tasks failed.\n");
+
+        for (size_t i = 0; i < n; ++i)
+            thread_pool_free(pool, runnables[i].arg, sizeof(wrap_t));
+
+        free(runnables);
+        futures_cancel(futures, n);
         return -1;
     }
 
-    wrapper->runnable = my_runnable;
+    free(runnables);
 
-    if (defer(pool, *my_runnable) != 0) {
-        err("async(): Submitting new callable task failed.\n");
-        free(wrapper);
-        free(my_runnable);
+    return 0;
+}
+
+/* Submits the continuation of a future which is done */
+static int map_schedule(map_wrap_t *wrapper) {
+    runnable_t my_runnable = {
+            .function = map_runnable,
+            .arg = wrapper,
+            .argsz = 0 /* Not copied, see callable_to_runnable() */
+    };
+
+    return defer(wrapper->pool, my_runnable);
+}
+
+/**
+ * Registers the continuation on the future.
+ * @return 0 on success, -1 if the future is done already.
+ */
+static int continuation_push(future_t *future, map_wrap_t *wrapper) {
+    map_wrap_t *head = atomic_load_explicit(&future->continuations, memory_order_acquire);
+
+    while (head != FUTURE_CLOSED) {
+        wrapper->next = head;
+
+        if (atomic_compare_exchange_weak_explicit(&future->continuations, &head, wrapper,
+                                                  memory_order_release, memory_order_acquire))
+            return 0;
+    }
+
+    return -1;
+}
+
+/* Registers the map on from, holding the reference shared to it if from is a shared future */
+static int map_register(thread_pool_t *pool, future_t *future, future_t *from,
+                        function_t function, shared_future_t *shared) {
+    if (future_init(future) == -1) {
+        err("map(): future_init() failed as future is NULL.\n");
+        return -1;
+    }
+
+    if (pool == NULL) {
+        err("map(): map is called on null pointer.\n");
+        future_cancel(future);
+        return -1;
+    }
+
+    map_wrap_t *wrapper = thread_pool_alloc(pool, sizeof(map_wrap_t));
+    if (wrapper == NULL) {
+        err("map(): malloc failed for creating map_wrapper.\n");
+        future_cancel(future);
+        return -1;
+    }
+
+    wrapper->func = function;
+    wrapper->future_from = from;
+    wrapper->new_future = future;
+    wrapper->pool = pool;
+    wrapper->when = NULL;
+    wrapper->shared = shared;
+
+    if (continuation_push(from, wrapper) == 0)
+        return 0;
+
+    if (map_schedule(wrapper) != 0) {
+        err("map(): Submitting new task failed.\n");
+        thread_pool_free(pool, wrapper, sizeof(map_wrap_t));
+        future_cancel(future);
         return -1;
     }
 
@@ -141,8 +383,12 @@ int async(thread_pool_t *pool, future_t *future, callable_t callable) {
 
 /**
  * Function uses 'from' future and 'function' to map a new future.
- * Multiple maps on the same future is an undefined behaviour, as
- * after mapping future 'from' is destroyed.
+ * No thread waits for 'from': the mapping is registered as its continuation
+ * and submitted to the pool when 'from' is done, or at once if it is done already.
+ * If 'from' was cancelled, the function is not called and 'future' is cancelled too.
+ * Any number of maps may be registered on the same future, each of them
+ * runs once, but 'from' must stay valid until all of them ran; a shared
+ * future, see shared_map(), keeps itself valid instead.
  * @param pool     - pointer on thread_pool
  * @param future   - pointer on future to be mapped
  * @param from     - pointer on base future to map another future
@@ -151,39 +397,147 @@ int async(thread_pool_t *pool, future_t *future, callable_t callable) {
  */
 int map(thread_pool_t *pool, future_t *future, future_t *from,
         void *(*function)(void *, size_t, size_t *)) {
+    return map_register(pool, future, from, function, NULL);
+}
 
-    if (future_init(future) == -1) {
-        err("map(): future_init() failed as future is NULL.\n");
-        return -1;
+/**
+ * Called once for every arm as its future gets done, and once by the
+ * registering thread, without ever blocking. For when_any() the first arm
+ * of a future not cancelled sets out, for when_all() the last one, and the
+ * last one frees the state.
+ * @param when - pointer to the state of the combinator.
+ * @param arm  - the arm done, NULL for the registering thread.
+ */
+static void when_arm_done(when_t *when, map_wrap_t *arm) {
+    /* The last arm reads the state of every future, each arm makes sure of its own */
+    if (arm != NULL)
+        future_settle(arm->future_from);
+
+    /* A cancelled future has no result to win with */
+    if (arm != NULL && !when->all && !future_is_cancelled(arm->future_from) &&
+        !atomic_exchange_explicit(&when->won, true, memory_order_relaxed))
+        future_set(when->out, arm->future_from, 0);
+
+    /* Release the results of the futures to the last arm, which reads them all */
+    if (atomic_fetch_sub_explicit(&when->remaining, 1, memory_order_acq_rel) != 1)
+        return;
+
+    if (when->all) {
+        bool cancelled = false;
+
+        for (size_t i = 0; i < when->n; ++i) {
+            when->results[i] = when->futures[i].result;
+            cancelled |= future_is_cancelled(&when->futures[i]);
+        }
+
+        /* Without every result there is nothing to join */
+        if (cancelled) {
+            free(when->results);
+            future_complete(when->out, NULL, 0, FUTURE_READY | FUTURE_CANCELLED);
+        } else {
+            future_set(when->out, when->results, when->n * sizeof(void *));
+        }
+    } else if (!atomic_load_explicit(&when->won, memory_order_relaxed)) {
+        /* Every future was cancelled */
+        future_cancel(when->out);
     }
 
-    map_wrap_t *wrapper = malloc(sizeof(map_wrap_t));
-    if (wrapper == NULL) {
-        err("map(): malloc failed for creating map_wrapper.\n");
+    thread_pool_free(when->pool, when, sizeof(when_t) + when->n * sizeof(map_wrap_t));
+}
+
+/* Registers an arm of the combinator on each of the futures, an arm of a done future runs at once */
+static int when_init(thread_pool_t *pool, future_t *out, future_t *futures, size_t n, bool all) {
+    if (future_init(out) == -1)
+        return -1;
+
+    if (pool == NULL) {
+        future_cancel(out);
         return -1;
     }
 
-    wrapper->func = function;
-    wrapper->future_from = from;
-    wrapper->new_future = future;
-    wrapper->runnable = NULL;
+    when_t *when = thread_pool_alloc(pool, sizeof(when_t) + n * sizeof(map_wrap_t));
+    void **results = NULL;
 
-    runnable_t *my_runnable = malloc(sizeof(runnable_t));
-    if (my_runnable == NULL) {
-        err("map(): malloc failed for creating runnable.\n");
+    if (when == NULL) {
+        future_cancel(out);
         return -1;
     }
 
-    my_runnable->function = map_runnable;
-    my_runnable->arg = wrapper;
-    my_runnable->argsz = sizeof(map_wrap_t);
+    if (all && n > 0 && (results = malloc(n * sizeof(void *))) == NULL) {
+        thread_pool_free(pool, when, sizeof(when_t) + n * sizeof(map_wrap_t));
+        future_cancel(out);
+        return -1;
+    }
 
-    wrapper->runnable = my_runnable;
+    atomic_init(&when->remaining, n + 1);
+    atomic_init(&when->won, false);
+    when->all = all;
+    when->out = out;
+    when->futures = futures;
+    when->results = results;
+    when->n = n;
+    when->pool = pool;
 
-    if (defer(pool, *my_runnable) != 0) {
-        err("map(): Submitting new task failed.\n");
-        free(wrapper);
-        free(my_runnable);
+    for (size_t i = 0; i < n; ++i) {
+        map_wrap_t *arm = &when->arms[i];
+
+        arm->future_from = &futures[i];
+        arm->func = NULL;
+        arm->new_future = out;
+        arm->pool = NULL;
+        arm->when = when;
+        arm->shared = NULL;
+
+        if (continuation_push(&futures[i], arm) == -1)
+            when_arm_done(when, arm);
+    }
+
+    /* Arms done meanwhile could not free the state, as the registering thread holds it */
+    when_arm_done(when, NULL);
+
+    return 0;
+}
+
+/**
+ * Creates a future done once all of the n futures are done.
+ * No thread waits for them: each of them counts down a shared counter as it
+ * gets done, and the last one sets the result of out.
+ * The result of out is a malloc-ed array of the n results, in the order of
+ * the futures, to be freed by the user, NULL if n is 0. If any of the
+ * futures was cancelled, out is cancelled too and has no result.
+ * The futures stay valid to await.
+ * @param pool    - pointer on thread_pool which recycles the state of the combinator
+ * @param out     - pointer on the future to be created
+ * @param futures - array of n futures, valid until out is done
+ * @param n       - number of the futures
+ * @return 0 on success, otherwise -1 if some failures happened.
+ */
+int when_all(thread_pool_t *pool, future_t *out, future_t *futures, size_t n) {
+    if (when_init(pool, out, futures, n, true) == -1) {
+        err("when_all(): creating the combinator failed.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Creates a future done as soon as any of the n futures is done.
+ * No thread waits for them: the first one done wins a shared flag
+ * and sets the result of out, the others only count down. Cancelled
+ * futures are skipped, and out is cancelled only once all of them are.
+ * The result of out is a pointer to the future done first, whose
+ * await() returns at once. Each of the futures must get done eventually,
+ * as they share the state of the combinator.
+ * @param pool    - pointer on thread_pool which recycles the state of the combinator
+ * @param out     - pointer on the future to be created
+ * @param futures - array of n futures, valid until all of them are done
+ * @param n       - number of the futures, at least 1
+ * @return 0 on success, otherwise -1 if some failures happened.
+ */
+int when_any(thread_pool_t *pool, future_t *out, future_t *futures, size_t n) {
+    if (n == 0 || when_init(pool, out, futures, n, false) == -1) {
+        err("when_any(): creating the combinator failed.\n");
         return -1;
     }
 
@@ -192,8 +546,9 @@ int map(thread_pool_t *pool, future_t *future, future_t *from,
 
 /**
  * Blocking function. Calling thread waits until future result
- * will be ready to take. After await, future is destroyed, so
- * multiple awaits on the same future is undefined behaviour.
+ * will be ready to take. After await, future is destroyed, so the
+ * future may be awaited again only as long as its memory is valid,
+ * see shared_await() for a future awaited by several threads.
  * @param future - pointer to the future
  * @return pointer to the result of future, which may also be NULL.
  */
@@ -204,6 +559,44 @@ void *await(future_t *future) {
     return res;
 }
 
+/**
+ * Tells whether the future was cancelled, that is it is done without a
+ * result as its callable was skipped, or it is a map of a cancelled future.
+ * @param future - pointer to the future, which is done.
+ * @return true if the future was cancelled.
+ */
+bool future_is_cancelled(future_t *future) {
+    return (atomic_load_explicit(&future->state, memory_order_acquire) & FUTURE_CANCELLED) != 0;
+}
+
+/**
+ * Initializes a token which is not cancelled.
+ * @param token - pointer to the token.
+ */
+void cancel_token_init(cancel_token_t *token) {
+    atomic_init(&token->cancelled, false);
+}
+
+/**
+ * Cancels the token. Callables with the token which were not taken from
+ * the queue yet are skipped, and their futures are done as cancelled.
+ * Callables running already may see it with cancel_token_is_cancelled().
+ * @param token - pointer to the token.
+ */
+void cancel_token_cancel(cancel_token_t *token) {
+    atomic_store_explicit(&token->cancelled, true, memory_order_release);
+}
+
+/**
+ * Tells whether the token was cancelled, costs a single load, so a long
+ * running callable may poll it often and return early.
+ * @param token - pointer to the token, may be NULL for a token never cancelled.
+ * @return true if the token was cancelled.
+ */
+bool cancel_token_is_cancelled(cancel_token_t *token) {
+    return token != NULL && atomic_load_explicit(&token->cancelled, memory_order_acquire);
+}
+
 /**
  * Initializes future parameters.
  * @param future - pointer to a future.
@@ -217,64 +610,508 @@ int future_init(future_t *future) {
 
     future->result = NULL;
     future->resultSz = 0;
-    future->done = false;
-
-    if (pthread_mutex_init(&future->mutex, NULL) != 0) {
-        err("future_init(): mutex initialisation failed.\n");
-        return -1;
-    }
-
-    if (pthread_cond_init(&future->cond, NULL) != 0) {
-        err("future_init(): condition initialisation failed.\n");
-        return -1;
-    }
+    atomic_init(&future->state, FUTURE_PENDING);
+    atomic_init(&future->continuations, NULL);
 
     return 0;
 }
 
 /**
- * Sets the result and result size of the future.
+ * Sets the result and result size of the future
+ * and submits the maps registered on it.
  * @param future   - pointer on the future.
  * @param result   - pointer on the result.
  * @param resultSz - size of the result of the future.
  */
 void future_set(future_t *future, void *result, size_t resultSz) {
-    pthread_mutex_lock(&future->mutex);
+    future_complete(future, result, resultSz, FUTURE_READY);
+}
 
+/**
+ * Completes the future as cancelled, without a result. A future whose
+ * task could not be submitted ends so, as waiting for it must return.
+ * @param future - pointer on the future, which is pending.
+ */
+static void future_cancel(future_t *future) {
+    future_complete(future, NULL, 0, FUTURE_READY | FUTURE_CANCELLED);
+}
+
+/**
+ * Sets the result of the future with the final state done, FUTURE_READY
+ * possibly with FUTURE_CANCELLED, and submits the maps registered on it.
+ */
+static void future_complete(future_t *future, void *result, size_t resultSz, uint32_t done) {
     future->result = result;
     future->resultSz = resultSz;
-    future->done = true;
 
-    /* Broadcast as other futures may wait to be created out of this future. */
-    pthread_cond_broadcast(&future->cond);
+    map_wrap_t *continuations = atomic_exchange_explicit(&future->continuations, FUTURE_CLOSED,
+                                                         memory_order_acq_rel);
+
+    /* Once ready, an awaiting thread may destroy the future, only its address is used below */
+    uint32_t state = atomic_exchange_explicit(&future->state, done, memory_order_release);
+
+    if (state & FUTURE_WAITERS)
+        futex_wake(&future->state, INT32_MAX);
+
+    /* A continuation may destroy the future, which is not touched anymore */
+    while (continuations != NULL) {
+        map_wrap_t *next = continuations->next;
+
+        /* An arm of a combinator costs an atomic or two, not worth a job */
+        if (continuations->when != NULL) {
+            when_arm_done(continuations->when, continuations);
+            continuations = next;
+            continue;
+        }
+
+        /* Rather run the continuation here than lose it, e.g. during thread_pool_destroy() */
+        if (map_schedule(continuations) != 0)
+            map_runnable(continuations, 0);
+
+        continuations = next;
+    }
+}
+
+/**
+ * Waits until the state of a future whose continuations are closed is
+ * published. future_complete() closes them first, as the future may be
+ * gone once its state is, so a continuation registered in between runs
+ * a moment before FUTURE_READY and FUTURE_CANCELLED are visible.
+ * @param future - pointer on the future, whose continuations are closed.
+ */
+static void future_settle(future_t *future) {
+    while (!(atomic_load_explicit(&future->state, memory_order_acquire) & FUTURE_READY))
+        sched_yield();
+}
+
+/* Current time on CLOCK_MONOTONIC, on which deadlines of the futures are measured */
+static uint64_t future_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/**
+ * Waits until the future is done, for at most timeout_ns.
+ * A ready future costs a single load, otherwise the thread sleeps on the state word.
+ * A thread of a thread pool runs the pool's other jobs while it waits, and
+ * sleeps only for short, growing periods when there is none to run, as a
+ * job it could help with may be deferred meanwhile. A job it runs may
+ * make it return later than timeout_ns.
+ * @param future     - pointer on the future.
+ * @param timeout_ns - longest wait, UINT64_MAX for none.
+ * @return 0 once the future is done, -1 if the time ran out before.
+ */
+static int future_wait(future_t *future, uint64_t timeout_ns) {
+    uint32_t state = atomic_load_explicit(&future->state, memory_order_acquire);
+    long wait_ns = FUTURE_HELP_MIN_WAIT_NS;
+    int helping = 1;
+    uint64_t deadline = UINT64_MAX;
+
+    if (state & FUTURE_READY)
+        return 0;
+
+    if (timeout_ns != UINT64_MAX) {
+        uint64_t now = future_now_ns();
+
+        deadline = timeout_ns < UINT64_MAX - now ? now + timeout_ns : UINT64_MAX;
+    }
+
+    while (!(state & FUTURE_READY)) {
+        if (helping) {
+            int ran = thread_pool_help();
+
+            if (ran == 1) {
+                wait_ns = FUTURE_HELP_MIN_WAIT_NS;
+                state = atomic_load_explicit(&future->state, memory_order_acquire);
+
+                if (!(state & FUTURE_READY) && deadline != UINT64_MAX && future_now_ns() >= deadline)
+                    return -1;
+
+                continue;
+            }
+
+            helping = ran == 0;
+        }
 
-    pthread_mutex_unlock(&future->mutex);
+        /* Tell future_set() there is somebody to wake, a failed CAS reloads the state */
+        if (state == FUTURE_PENDING &&
+            !atomic_compare_exchange_weak_explicit(&future->state, &state, FUTURE_WAITERS,
+                                                   memory_order_acquire, memory_order_acquire))
+            continue;
+
+        uint64_t sleep_ns = helping ? (uint64_t) wait_ns : UINT64_MAX;
+
+        if (deadline != UINT64_MAX) {
+            uint64_t now = future_now_ns();
+
+            if (now >= deadline)
+                return -1;
+
+            if (deadline - now < sleep_ns)
+                sleep_ns = deadline - now;
+        }
+
+        if (sleep_ns != UINT64_MAX) {
+            struct timespec timeout = {.tv_sec = (time_t) (sleep_ns / 1000000000u),
+                                       .tv_nsec = (long) (sleep_ns % 1000000000u)};
+            futex_wait(&future->state, FUTURE_WAITERS, &timeout);
+
+            if (helping && wait_ns < FUTURE_HELP_MAX_WAIT_NS)
+                wait_ns *= 2;
+        } else {
+            futex_wait(&future->state, FUTURE_WAITERS, NULL);
+        }
+
+        state = atomic_load_explicit(&future->state, memory_order_acquire);
+    }
+
+    return 0;
 }
 
 /**
  * Returns the future value.
- * Function is a blocking function as future may be not ready to get its result.
+ * Function is a blocking function as future may be not ready to get its result,
+ * see future_wait().
  * @param future - pointer on the future.
  * @return returns future value as it gets ready.
  */
 void *future_get(future_t *future) {
-    pthread_mutex_lock(&future->mutex);
+    future_wait(future, UINT64_MAX);
 
-    while (!future->done) {
-        pthread_cond_wait(&future->cond, &future->mutex);
+    return future->result;
+}
+
+/**
+ * Tells whether the future is done, with a single load and without blocking.
+ * @param future - pointer on the future.
+ * @return true if the result of the future is set.
+ */
+bool future_is_ready(future_t *future) {
+    return (atomic_load_explicit(&future->state, memory_order_acquire) & FUTURE_READY) != 0;
+}
+
+/**
+ * Takes the result of the future if it is done, without blocking.
+ * The future stays valid either way.
+ * @param future - pointer on the future.
+ * @param out    - where the result is stored if the future is done.
+ * @return 0 if the future is done, otherwise -1 with errno set to EAGAIN.
+ */
+int future_try_get(future_t *future, void **out) {
+    if (!future_is_ready(future)) {
+        errno = EAGAIN;
+        return -1;
     }
 
-    pthread_mutex_unlock(&future->mutex);
+    *out = future->result;
 
-    return future->result;
+    return 0;
 }
 
 /**
- * Destroys the future by destroying its mutex and condition.
- * Note that result cannot be free-d as it is the responsibility of the user.
+ * As await(), but waits for at most timeout_ns, measured on CLOCK_MONOTONIC.
+ * If the time runs out, the future stays pending and valid: it may be
+ * awaited or polled again, or destroyed with future_destroy().
+ * @param future     - pointer to the future
+ * @param timeout_ns - longest wait in nanoseconds
+ * @param out        - where the result is stored if the future gets done
+ * @return 0 on success, otherwise -1 with errno set to ETIMEDOUT.
+ */
+int await_timeout(future_t *future, uint64_t timeout_ns, void **out) {
+    if (future_wait(future, timeout_ns) == -1) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    *out = future->result;
+    future_destroy(future);
+
+    return 0;
+}
+
+/**
+ * Ends the life of the future, after which its memory may be reused.
+ * A future which is still pending, e.g. after await_timeout() timed out,
+ * is waited for first, as its task writes the result into it. A future
+ * whose async(), map() or alike failed is done as cancelled already. Cancelling
+ * the token of its callable beforehand makes that wait short if the
+ * callable did not start yet. The result of the future is not freed,
+ * as it is the responsibility of the user.
  * @param future - pointer on the future.
  */
 void future_destroy(future_t *future) {
-    pthread_mutex_destroy(&future->mutex);
-    pthread_cond_destroy(&future->cond);
-}
\ No newline at end of file
+    future_wait(future, UINT64_MAX);
+}
+
+/* A thread of a thread pool waiting for a task group looks for jobs to help with this often */
+#define TASK_GROUP_HELP_WAIT_NS 100000L
+
+/**
+ * Initializes an empty task group of the pool.
+ * @param group    - pointer to the task group.
+ * @param pool     - pointer on the thread_pool which runs the tasks.
+ * @param results  - array where the result of the i-th task run is stored, may be NULL.
+ * @param capacity - size of results, the most tasks the group may run between waits.
+ * @return 0 on success, otherwise -1.
+ */
+int task_group_init(task_group_t *group, thread_pool_t *pool, void **results, size_t capacity) {
+    if (group == NULL || pool == NULL) {
+        err("task_group_init(): group or pool is a null pointer.\n");
+        return -1;
+    }
+
+    group->pool = pool;
+    group->results = results;
+    group->capacity = capacity;
+    atomic_init(&group->runs, 0);
+    atomic_init(&group->pending, 0);
+    atomic_init(&group->records, NULL);
+
+    return 0;
+}
+
+static void task_record_release(task_record_t *record) {
+    if (atomic_fetch_sub_explicit(&record->refs, 1, memory_order_acq_rel) == 1)
+        thread_pool_free(record->pool, record, sizeof(task_record_t));
+}
+
+/* Runs the task, which the caller has claimed */
+static void task_record_run(task_record_t *record) {
+    task_group_t *group = record->group;
+    size_t result_size = 0;
+    void *result = NULL;
+
+    /* A cancelled task is skipped, its result is NULL */
+    if (!cancel_token_is_cancelled(record->callable.token))
+        result = record->callable.function(record->callable.arg, record->callable.argsz, &result_size);
+
+    if (group->results != NULL)
+        group->results[record->index] = result;
+
+    /* The waiting thread may return as soon as it sees 0, only the address of pending is used then */
+    if (atomic_fetch_sub_explicit(&group->pending, 1, memory_order_acq_rel) == 1)
+        futex_wake(&group->pending, INT32_MAX);
+}
+
+/* Job of a task, which does nothing if the waiting thread ran the task already */
+static void task_group_job(void *arg, size_t argsz __attribute__ ((unused))) {
+    task_record_t *record = arg;
+
+    if (!atomic_exchange_explicit(&record->claimed, true, memory_order_acquire))
+        task_record_run(record);
+
+    task_record_release(record);
+}
+
+/**
+ * Runs the callable on the pool as a task of the group. The argument
+ * of the callable must stay valid until task_group_wait() returns.
+ * A task may run further tasks of its own group, or of a nested one.
+ * A run which fails takes no index, so it leaves no hole in the results:
+ * the i-th task run successfully stores its result in results[i].
+ * @param group    - pointer to the task group.
+ * @param callable - task to be run.
+ * @return 0 on success, otherwise -1.
+ */
+int task_group_run(task_group_t *group, callable_t callable) {
+    task_record_t *record = thread_pool_alloc(group->pool, sizeof(task_record_t));
+
+    if (record == NULL) {
+        err("task_group_run(): malloc failed for creating task record.\n");
+        return -1;
+    }
+
+    size_t index = atomic_load_explicit(&group->runs, memory_order_relaxed);
+
+    /* The index is taken only while there is a result for it */
+    do {
+        if (group->results != NULL && index >= group->capacity) {
+            err("task_group_run(): More tasks than results.\n");
+            thread_pool_free(group->pool, record, sizeof(task_record_t));
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&group->runs, &index, index + 1,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    record->callable = callable;
+    record->group = group;
+    record->pool = group->pool;
+    record->index = index;
+    atomic_init(&record->claimed, false);
+    atomic_init(&record->refs, 2);
+
+    atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+
+    task_record_t *head = atomic_load_explicit(&group->records, memory_order_relaxed);
+
+    do {
+        record->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&group->records, &head, record,
+                                                    memory_order_release, memory_order_relaxed));
+
+    runnable_t runnable = {.function = task_group_job, .arg = record, .argsz = 0};
+
+    /* Rather run the task here than lose it, e.g. during thread_pool_destroy() */
+    if (defer(group->pool, runnable) != 0)
+        task_group_job(record, 0);
+
+    return 0;
+}
+
+/**
+ * Waits until every task run by the group is done, the nested ones too.
+ * The calling thread runs the tasks of the group nobody took yet, then
+ * a thread of a thread pool runs other jobs of its pool and any other
+ * thread sleeps until the last task wakes it up. The group may be used
+ * again after the wait.
+ * @param group - pointer to the task group.
+ * @return 0 on success, otherwise -1.
+ */
+int task_group_wait(task_group_t *group) {
+    if (group == NULL) {
+        err("task_group_wait(): group is a null pointer.\n");
+        return -1;
+    }
+
+    task_record_t *seen = NULL;
+
+    for (;;) {
+        /* Every task older than seen is claimed already, by this thread or a job */
+        task_record_t *head = atomic_load_explicit(&group->records, memory_order_acquire);
+
+        for (task_record_t *record = head; record != seen; record = record->next) {
+            if (!atomic_load_explicit(&record->claimed, memory_order_relaxed) &&
+                !atomic_exchange_explicit(&record->claimed, true, memory_order_acquire))
+                task_record_run(record);
+        }
+
+        seen = head;
+
+        uint32_t pending = atomic_load_explicit(&group->pending, memory_order_acquire);
+
+        if (pending == 0)
+            break;
+
+        /* Tasks the ones running now add are looked for once they are done or a job was helped with */
+        int ran = thread_pool_help();
+
+        if (ran == 1)
+            continue;
+
+        struct timespec timeout = {.tv_sec = 0, .tv_nsec = TASK_GROUP_HELP_WAIT_NS};
+        futex_wait(&group->pending, pending, ran == 0 ? &timeout : NULL);
+    }
+
+    task_record_t *record = atomic_exchange_explicit(&group->records, NULL, memory_order_acquire);
+
+    while (record != NULL) {
+        task_record_t *next = record->next;
+
+        task_record_release(record);
+        record = next;
+    }
+
+    atomic_store_explicit(&group->runs, 0, memory_order_relaxed);
+
+    return 0;
+}
+
+/**
+ * Submits the callable as async() does, into a shared future allocated
+ * by the pool. The shared future is reference counted: the caller gets
+ * one reference, and any number of awaits and maps may use it, taking
+ * references of their own. It is freed, together with its result if
+ * destroy_result is given, when the last reference is released, which
+ * never happens before its task is done.
+ * @param pool           - pointer on the thread_pool
+ * @param callable       - callable task to be submitted to thread_pool.
+ * @param destroy_result - called on the result with the last reference, may be NULL.
+ * @return pointer to the shared future, NULL if some failures happened.
+ */
+shared_future_t *shared_async(thread_pool_t *pool, callable_t callable, void (*destroy_result)(void *)) {
+    if (pool == NULL) {
+        err("shared_async(): shared_async is called on null pointer.\n");
+        return NULL;
+    }
+
+    shared_future_t *shared = thread_pool_alloc(pool, sizeof(shared_future_t));
+
+    if (shared == NULL) {
+        err("shared_async(): malloc failed for creating shared future.\n");
+        return NULL;
+    }
+
+    /* One for the caller, one for the task which sets the result */
+    atomic_init(&shared->refs, 2);
+    shared->pool = pool;
+    shared->destroy_result = destroy_result;
+
+    if (async_submit(pool, &shared->future, callable, THREAD_POOL_PRIO_NORMAL, shared) == -1) {
+        thread_pool_free(pool, shared, sizeof(shared_future_t));
+        return NULL;
+    }
+
+    return shared;
+}
+
+/**
+ * Takes another reference to the shared future.
+ * @param shared - pointer to the shared future, to which the caller holds a reference.
+ * @return the shared future.
+ */
+shared_future_t *shared_future_ref(shared_future_t *shared) {
+    atomic_fetch_add_explicit(&shared->refs, 1, memory_order_relaxed);
+
+    return shared;
+}
+
+/**
+ * Releases a reference to the shared future. The last one frees it,
+ * with its result if the future has a destroy_result function.
+ * @param shared - pointer to the shared future, not to be used by the caller anymore.
+ */
+void shared_future_release(shared_future_t *shared) {
+    if (atomic_fetch_sub_explicit(&shared->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    if (shared->destroy_result != NULL && shared->future.result != NULL)
+        shared->destroy_result(shared->future.result);
+
+    thread_pool_free(shared->pool, shared, sizeof(shared_future_t));
+}
+
+/**
+ * Maps a new future from the shared future, as map() does. The map
+ * takes a reference of its own, which it releases once it ran, so the
+ * caller may release its reference at once. The function gets the
+ * shared result, which it must neither change nor free.
+ * @param pool     - pointer on thread_pool
+ * @param future   - pointer on future to be mapped
+ * @param from     - pointer on the shared future, to which the caller holds a reference
+ * @param function - function pointer to map the new future
+ * @return 0 on success, otherwise -1 if some failures happened.
+ */
+int shared_map(thread_pool_t *pool, future_t *future, shared_future_t *from,
+               void *(*function)(void *, size_t, size_t *)) {
+    shared_future_ref(from);
+
+    if (map_register(pool, future, &from->future, function, from) == -1) {
+        shared_future_release(from);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Waits for the shared future, as await() does, but keeps it: any number
+ * of threads may await it at the same time. The result stays valid for
+ * as long as the caller holds its reference.
+ * @param shared - pointer to the shared future, to which the caller holds a reference.
+ * @return pointer to the result of future, which may also be NULL.
+ */
+void *shared_await(shared_future_t *shared) {
+    return future_get(&shared->future);
+}
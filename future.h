@@ -1,29 +1,107 @@
 #ifndef FUTURE_H
 #define FUTURE_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "threadpool.h"
 
+/* Set once by the caller who stopped caring about the results, polled by the tasks */
+typedef struct cancel_token {
+    atomic_bool cancelled;
+} cancel_token_t;
+
 typedef struct callable {
     void *(*function)(void *, size_t, size_t *);
 
     void *arg;
     size_t argsz;
+    cancel_token_t *token; /* The callable is skipped once it is cancelled, may be NULL */
 } callable_t;
 
 typedef struct future {
     void *result;
     size_t resultSz;
-    bool done;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
+    _Atomic uint32_t state;                   /* Pending or ready, with a flag for sleeping waiters */
+    _Atomic(struct map_wrap *) continuations; /* Maps scheduled once the future is done */
 } future_t;
 
+/* Reference counted future, freed with the last reference */
+typedef struct shared_future {
+    future_t future;                 /* Awaited and mapped as any future */
+    atomic_size_t refs;
+    thread_pool_t *pool;             /* Recycles the shared future */
+    void (*destroy_result)(void *);  /* Called on the result with the last reference, may be NULL */
+} shared_future_t;
+
+/* Task run by a task group, taken either by its job or by the thread waiting for the group */
+typedef struct task_record {
+    callable_t callable;
+    struct task_group *group;
+    thread_pool_t *pool;
+    size_t index;              /* Order of task_group_run(), index of the result */
+    atomic_bool claimed;       /* Set by whoever runs the task */
+    atomic_uint refs;          /* The job and the group, the last one frees the record */
+    struct task_record *next;  /* Task run before this one */
+} task_record_t;
+
+typedef struct task_group {
+    thread_pool_t *pool;
+    void **results;            /* Result of the i-th task goes to results[i], NULL for none */
+    size_t capacity;           /* Size of results */
+    atomic_size_t runs;        /* Tasks run since init or the last wait */
+    _Atomic uint32_t pending;  /* Tasks not done yet, the waiting thread sleeps on it */
+    _Atomic(task_record_t *) records; /* Tasks run, latest first */
+} task_group_t;
+
+void cancel_token_init(cancel_token_t *token);
+
+void cancel_token_cancel(cancel_token_t *token);
+
+bool cancel_token_is_cancelled(cancel_token_t *token);
+
 int async(thread_pool_t *pool, future_t *future, callable_t callable);
 
+int async_prio(thread_pool_t *pool, future_t *future, callable_t callable, thread_pool_prio prio);
+
+int async_bulk(thread_pool_t *pool, future_t *futures, callable_t *callables, size_t n);
+
 int map(thread_pool_t *pool, future_t *future, future_t *from,
         void *(*function)(void *, size_t, size_t *));
 
+int when_all(thread_pool_t *pool, future_t *out, future_t *futures, size_t n);
+
+/* Skips cancelled futures, out is cancelled only once every one of them is */
+int when_any(thread_pool_t *pool, future_t *out, future_t *futures, size_t n);
+
 void *await(future_t *future);
 
+int await_timeout(future_t *future, uint64_t timeout_ns, void **out);
+
+bool future_is_ready(future_t *future);
+
+int future_try_get(future_t *future, void **out);
+
+/* Waits until a pending future is done, failed submissions leave theirs done as cancelled */
+void future_destroy(future_t *future);
+
+bool future_is_cancelled(future_t *future);
+
+shared_future_t *shared_async(thread_pool_t *pool, callable_t callable, void (*destroy_result)(void *));
+
+shared_future_t *shared_future_ref(shared_future_t *shared);
+
+void shared_future_release(shared_future_t *shared);
+
+int shared_map(thread_pool_t *pool, future_t *future, shared_future_t *from,
+               void *(*function)(void *, size_t, size_t *));
+
+void *shared_await(shared_future_t *shared);
+
+int task_group_init(task_group_t *group, thread_pool_t *pool, void **results, size_t capacity);
+
+int task_group_run(task_group_t *group, callable_t callable);
+
+int task_group_wait(task_group_t *group);
+
 #endif
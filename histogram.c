@@ -0,0 +1,90 @@
+#include "histogram.h"
+
+static unsigned int bucket_of(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (unsigned int) value;
+
+    unsigned int exponent = 63 - (unsigned int) __builtin_clzll(value);
+    unsigned int sub = (unsigned int) (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+/* Highest value which falls into the bucket */
+static uint64_t bucket_max(unsigned int bucket) {
+    unsigned int group = bucket / HISTOGRAM_SUB_BUCKETS;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+
+    if (group == 0)
+        return sub;
+
+    unsigned int shift = group - 1;
+
+    return ((HISTOGRAM_SUB_BUCKETS + sub) << shift) + ((uint64_t) 1 << shift) - 1;
+}
+
+void histogram_init(histogram *h) {
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        atomic_init(&h->counts[i], 0);
+    }
+}
+
+/* Owner thread only */
+void histogram_record(histogram *h, uint64_t value) {
+    _Atomic uint64_t *count = &h->counts[bucket_of(value)];
+
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+/* Adds the counts of from to the histogram to, which no other thread may use meanwhile */
+void histogram_add(histogram *to, const histogram *from) {
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        uint64_t count = atomic_load_explicit(&from->counts[i], memory_order_relaxed);
+
+        if (count != 0)
+            atomic_store_explicit(&to->counts[i], atomic_load_explicit(&to->counts[i], memory_order_relaxed) + count,
+                                  memory_order_relaxed);
+    }
+}
+
+uint64_t histogram_count(const histogram *h) {
+    uint64_t total = 0;
+
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        total += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+    }
+
+    return total;
+}
+
+/**
+ * Value below which the given percentage of the recorded values is.
+ * @param h          - pointer to the histogram.
+ * @param percentile - from 0 to 100.
+ * @return the highest value of the bucket of the percentile, 0 if nothing was recorded.
+ */
+uint64_t histogram_percentile(const histogram *h, double percentile) {
+    uint64_t total = histogram_count(h);
+
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (percentile / 100.0 * (double) total + 0.5);
+
+    if (rank == 0)
+        rank = 1;
+
+    if (rank > total)
+        rank = total;
+
+    uint64_t seen = 0;
+
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+
+        if (seen >= rank)
+            return bucket_max(i);
+    }
+
+    return bucket_max(HISTOGRAM_BUCKETS - 1);
+}
@@ -0,0 +1,33 @@
+#ifndef ASYNC_HISTOGRAM_H
+#define ASYNC_HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * Log-linear histogram of 64-bit values, in the manner of HdrHistogram:
+ * every power of two is split into HISTOGRAM_SUB_BUCKETS buckets,
+ * so a value is known within 1 / HISTOGRAM_SUB_BUCKETS of itself.
+ * Recording is done by a single thread without any atomic read-modify-write,
+ * any thread may read the histogram meanwhile.
+ */
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram {
+    _Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+} histogram;
+
+void histogram_init(histogram *h);
+
+void histogram_record(histogram *h, uint64_t value);
+
+void histogram_add(histogram *to, const histogram *from);
+
+uint64_t histogram_count(const histogram *h);
+
+uint64_t histogram_percentile(const histogram *h, double percentile);
+
+#endif //ASYNC_HISTOGRAM_H
@@ -1,7 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "threadpool.h"
-#include <unistd.h>
 #include <pthread.h>
 
 #define NO_THREADS 4
@@ -17,82 +16,82 @@ typedef struct my_job {
 } my_job;
 
 static int *row_sum = NULL;
-static int count = 0;
 static pthread_mutex_t guard;
-static pthread_cond_t cond;
 
+/* Deferred once the value of the cell is evaluated, after its sleep_time */
 void runnable_function(void *arg, size_t argsz __attribute__((unused))) {
     my_job *job = (my_job *) arg;
 
-    /* Sleeps until a specified amount of time */
-    usleep(job->sleep_time * 1000);
-
     pthread_mutex_lock(&guard);
     row_sum[job->row] += job->val;
-    count++;
-    pthread_cond_signal(&cond);
     pthread_mutex_unlock(&guard);
 }
 
 int main() {
     pthread_mutex_init(&guard, 0);
-    pthread_cond_init(&cond, 0);
 
     int rows, columns;
     scanf("%d", &rows);
     scanf("%d", &columns);
 
     thread_pool_t pool;
-    thread_pool_init(&pool, NO_THREADS);
+    thread_pool_options_t options;
+    thread_pool_options_init(&options, NO_THREADS);
+    options.inline_args = true;
+
+    if (thread_pool_init_ex(&pool, &options) == -1) {
+        err("macierz: Initialising the thread pool failed.\n");
+        return 1;
+    }
 
     row_sum = calloc(rows, sizeof(int));
 
-    my_job **jobArray = malloc(rows * columns * sizeof(my_job *));
-    runnable_t **runArray = malloc(rows * columns * sizeof(runnable_t));
-    for (int i = 0; i < rows * columns; ++i) {
+    /* Cells without a delay need no timer, they are deferred together with a single defer_bulk() */
+    my_job *jobArray = malloc(rows * columns * sizeof(my_job));
+    runnable_t *runArray = malloc(rows * columns * sizeof(runnable_t));
+    size_t now = 0;
+    int failed = rows * columns > 0 && (row_sum == NULL || jobArray == NULL || runArray == NULL);
+
+    for (int i = 0; i < rows * columns && !failed; ++i) {
         /* Creating Job */
-        my_job *new_my_job = malloc(sizeof(my_job));
+        my_job *new_my_job = &jobArray[i];
 
         new_my_job->row = floor((double) i / (double) columns);
 
         scanf("%d", &new_my_job->val);
         scanf("%d", &new_my_job->sleep_time);
 
-        jobArray[i] = new_my_job;
+        /* Creating Runnable, the pool keeps its own copy of the job */
+        runnable_t runnable = {.function = runnable_function, .arg = new_my_job, .argsz = sizeof(my_job)};
 
-        /* Creating Runnable */
-        runnable_t *new_runnable = malloc(sizeof(runnable_t));
+        if (new_my_job->sleep_time <= 0) {
+            runArray[now++] = runnable;
+            continue;
+        }
 
-        new_runnable->function = runnable_function;
-        new_runnable->arg = new_my_job;
-        new_runnable->argsz = sizeof(my_job);
-
-        runArray[i] = new_runnable;
-
-        /* Submit task to the thread pool */
-        defer(&pool, *new_runnable);
+        /* No thread sleeps while the cell is evaluated, the timer wheel of the pool waits instead */
+        failed = defer_after(&pool, runnable, (uint64_t) new_my_job->sleep_time * 1000000) == -1;
     }
 
-    pthread_mutex_lock(&guard);
-    while (count != rows * columns) {
-        pthread_cond_wait(&cond, &guard);
-    }
-    pthread_mutex_unlock(&guard);
+    if (!failed && now > 0)
+        failed = defer_bulk(&pool, runArray, now) == -1;
 
-    thread_pool_destroy(&pool);
+    /* Every cell is summed up once the pool has nothing left to do */
+    thread_pool_wait_idle(&pool);
 
-    for (int i = 0; i < rows; ++i) {
-        printf("%d\n", row_sum[i]);
-    }
+    thread_pool_destroy(&pool);
 
-    for (int i = 0; i < rows * columns; ++i) {
-        free(jobArray[i]);
-        free(runArray[i]);
+    if (failed) {
+        err("macierz: Submitting the cells failed.\n");
+    } else {
+        for (int i = 0; i < rows; ++i) {
+            printf("%d\n", row_sum[i]);
+        }
     }
 
     free(jobArray);
     free(runArray);
     free(row_sum);
 
-    return 0;
-}
\ No newline at end of file
+    return failed;
+}
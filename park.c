@@ -0,0 +1,316 @@
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "park.h"
+
+#ifdef __linux__
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * Sleeps as long as *addr equals expected, until woken up or timed out.
+ * @param addr     - pointer to the word.
+ * @param expected - value for which the thread should sleep.
+ * @param timeout  - relative timeout measured on CLOCK_MONOTONIC, NULL for none.
+ * @return 0 when woken up (possibly spuriously), otherwise -1 with errno
+ *         EAGAIN if *addr differed, ETIMEDOUT or EINTR.
+ */
+int futex_wait(_Atomic uint32_t *addr, uint32_t expected, const struct timespec *timeout) {
+    return (int) syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+/* Wakes up to count threads sleeping on addr */
+void futex_wake(_Atomic uint32_t *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+#else
+
+#include <pthread.h>
+
+#define PARK_BUCKETS 64
+
+typedef struct park_bucket {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} park_bucket;
+
+static park_bucket buckets[PARK_BUCKETS];
+static pthread_once_t buckets_once = PTHREAD_ONCE_INIT;
+
+static void buckets_init(void) {
+    for (int i = 0; i < PARK_BUCKETS; ++i) {
+        pthread_mutex_init(&buckets[i].mutex, NULL);
+        pthread_cond_init(&buckets[i].cond, NULL);
+    }
+}
+
+static park_bucket *bucket_of(_Atomic uint32_t *addr) {
+    pthread_once(&buckets_once, buckets_init);
+
+    return &buckets[((uintptr_t) addr >> 2) % PARK_BUCKETS];
+}
+
+int futex_wait(_Atomic uint32_t *addr, uint32_t expected, const struct timespec *timeout) {
+    park_bucket *bucket = bucket_of(addr);
+    int ret = 0;
+
+    pthread_mutex_lock(&bucket->mutex);
+
+    if (atomic_load(addr) != expected) {
+        errno = EAGAIN;
+        ret = -1;
+    } else if (timeout == NULL) {
+        pthread_cond_wait(&bucket->cond, &bucket->mutex);
+    } else {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout->tv_sec;
+        deadline.tv_nsec += timeout->tv_nsec;
+
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        if (pthread_cond_timedwait(&bucket->cond, &bucket->mutex, &deadline) == ETIMEDOUT) {
+            errno = ETIMEDOUT;
+            ret = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&bucket->mutex);
+
+    return ret;
+}
+
+/* Buckets are shared, so every sleeper of the bucket is woken up */
+void futex_wake(_Atomic uint32_t *addr, int count __attribute__ ((unused))) {
+    park_bucket *bucket = bucket_of(addr);
+
+    pthread_mutex_lock(&bucket->mutex);
+    pthread_cond_broadcast(&bucket->cond);
+    pthread_mutex_unlock(&bucket->mutex);
+}
+
+#endif
+
+void eventcount_init(eventcount *ec) {
+    atomic_init(&ec->epoch, 0);
+    atomic_init(&ec->waiters, 0);
+}
+
+/**
+ * Registers the calling thread as a waiter.
+ * The condition must be checked again after this call.
+ * @return key to be passed to eventcount_wait().
+ */
+uint32_t eventcount_prepare_wait(eventcount *ec) {
+    atomic_fetch_add_explicit(&ec->waiters, 1, memory_order_seq_cst);
+
+    return atomic_load_explicit(&ec->epoch, memory_order_seq_cst);
+}
+
+/* Unregisters a waiter which found the condition true */
+void eventcount_cancel_wait(eventcount *ec) {
+    atomic_fetch_sub_explicit(&ec->waiters, 1, memory_order_relaxed);
+}
+
+/* Sleeps unless there was a notification since eventcount_prepare_wait() */
+void eventcount_wait(eventcount *ec, uint32_t key) {
+    while (atomic_load_explicit(&ec->epoch, memory_order_acquire) == key) {
+        if (futex_wait(&ec->epoch, key, NULL) == -1 && errno != EINTR)
+            break;
+    }
+
+    atomic_fetch_sub_explicit(&ec->waiters, 1, memory_order_relaxed);
+}
+
+/**
+ * As eventcount_wait(), but sleeps for at most timeout_ns.
+ * @return 0 after a notification, -1 if the time ran out before one.
+ */
+int eventcount_wait_timeout(eventcount *ec, uint32_t key, uint64_t timeout_ns) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t start = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+    uint64_t elapsed = 0;
+    int ret = 0;
+
+    while (atomic_load_explicit(&ec->epoch, memory_order_acquire) == key) {
+        if (elapsed >= timeout_ns) {
+            ret = -1;
+            break;
+        }
+
+        uint64_t left = timeout_ns - elapsed;
+        struct timespec timeout = {.tv_sec = (time_t) (left / 1000000000u), .tv_nsec = (long) (left % 1000000000u)};
+
+        futex_wait(&ec->epoch, key, &timeout);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec - start;
+    }
+
+    atomic_fetch_sub_explicit(&ec->waiters, 1, memory_order_relaxed);
+
+    return ret;
+}
+
+/* Wakes up at most count waiters */
+void eventcount_notify(eventcount *ec, int count) {
+    /* Pairs with the fetch_add in prepare_wait: either the waiter sees the
+     * new condition, or we see the waiter */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&ec->waiters, memory_order_relaxed) == 0)
+        return;
+
+    atomic_fetch_add_explicit(&ec->epoch, 1, memory_order_release);
+    futex_wake(&ec->epoch, count);
+}
+
+void eventcount_notify_all(eventcount *ec) {
+    eventcount_notify(ec, INT_MAX);
+}
+
+int park_lot_init(park_lot *lot) {
+    lot->top = NULL;
+    atomic_init(&lot->parked, 0);
+
+    return pthread_mutex_init(&lot->mutex, NULL) == 0 ? 0 : -1;
+}
+
+void park_lot_destroy(park_lot *lot) {
+    pthread_mutex_destroy(&lot->mutex);
+}
+
+/**
+ * Puts the slot of the calling thread on the lot.
+ * The condition must be checked again after this call.
+ */
+void park_lot_prepare(park_lot *lot, park_slot *slot) {
+    atomic_store_explicit(&slot->state, PARK_PARKED, memory_order_relaxed);
+
+    pthread_mutex_lock(&lot->mutex);
+    slot->next = lot->top;
+    lot->top = slot;
+    atomic_fetch_add_explicit(&lot->parked, 1, memory_order_seq_cst);
+    pthread_mutex_unlock(&lot->mutex);
+
+    /* Pairs with the fence in park_lot_unpark() */
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/**
+ * Takes the slot off the lot, unless an unpark already did.
+ * @return 1 if the slot was taken off, 0 if it was unparked.
+ */
+static int park_lot_remove(park_lot *lot, park_slot *slot) {
+    int removed = 0;
+
+    pthread_mutex_lock(&lot->mutex);
+
+    if (atomic_load_explicit(&slot->state, memory_order_relaxed) == PARK_PARKED) {
+        park_slot **link = &lot->top;
+
+        while (*link != slot)
+            link = &(*link)->next;
+
+        *link = slot->next;
+        atomic_fetch_sub_explicit(&lot->parked, 1, memory_order_relaxed);
+        atomic_store_explicit(&slot->state, PARK_RUNNING, memory_order_relaxed);
+        removed = 1;
+    }
+
+    pthread_mutex_unlock(&lot->mutex);
+
+    return removed;
+}
+
+/* Takes the slot off the lot, unless an unpark already did */
+void park_lot_cancel(park_lot *lot, park_slot *slot) {
+    park_lot_remove(lot, slot);
+}
+
+/* Sleeps until the slot is unparked */
+void park_slot_wait(park_slot *slot) {
+    while (atomic_load_explicit(&slot->state, memory_order_acquire) == PARK_PARKED) {
+        futex_wait(&slot->state, PARK_PARKED, NULL);
+    }
+}
+
+/**
+ * Sleeps until the slot is unparked, or at most timeout_ns nanoseconds,
+ * after which the slot is taken off the lot.
+ * @return 0 if the slot was unparked, -1 if the wait timed out.
+ */
+int park_lot_wait_timeout(park_lot *lot, park_slot *slot, uint64_t timeout_ns) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t start = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+    uint64_t elapsed = 0;
+
+    while (atomic_load_explicit(&slot->state, memory_order_acquire) == PARK_PARKED) {
+        if (elapsed >= timeout_ns)
+            return park_lot_remove(lot, slot) ? -1 : 0;
+
+        uint64_t left = timeout_ns - elapsed;
+        struct timespec timeout = {.tv_sec = (time_t) (left / 1000000000u), .tv_nsec = (long) (left % 1000000000u)};
+
+        futex_wait(&slot->state, PARK_PARKED, &timeout);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec - start;
+    }
+
+    return 0;
+}
+
+/**
+ * Wakes up at most count parked threads.
+ * @return number of threads woken up.
+ */
+size_t park_lot_unpark(park_lot *lot, size_t count) {
+    /* Either the parking thread sees the new condition, or we see its slot */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&lot->parked, memory_order_relaxed) == 0)
+        return 0;
+
+    size_t n = 0;
+
+    while (n < count) {
+        pthread_mutex_lock(&lot->mutex);
+
+        park_slot *slot = lot->top;
+
+        if (slot == NULL) {
+            pthread_mutex_unlock(&lot->mutex);
+            break;
+        }
+
+        lot->top = slot->next;
+        atomic_fetch_sub_explicit(&lot->parked, 1, memory_order_relaxed);
+
+        /* The state changes under the mutex, so park_lot_cancel() knows whether it was unparked */
+        atomic_store_explicit(&slot->state, PARK_RUNNING, memory_order_release);
+
+        pthread_mutex_unlock(&lot->mutex);
+
+        futex_wake(&slot->state, 1);
+        ++n;
+    }
+
+    return n;
+}
+
+void park_lot_unpark_all(park_lot *lot) {
+    park_lot_unpark(lot, SIZE_MAX);
+}
@@ -0,0 +1,90 @@
+#ifndef ASYNC_PARK_H
+#define ASYNC_PARK_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Parking of threads on a 32-bit word.
+ * Uses futex on Linux, elsewhere a hashed table of mutexes and conditions.
+ */
+
+int futex_wait(_Atomic uint32_t *addr, uint32_t expected, const struct timespec *timeout);
+
+void futex_wake(_Atomic uint32_t *addr, int count);
+
+/**
+ * Eventcount: lets a thread sleep until some condition, checked without
+ * any lock, may have changed. A waiter does
+ *
+ *     key = eventcount_prepare_wait(ec);
+ *     if (condition) { eventcount_cancel_wait(ec); ... }
+ *     else eventcount_wait(ec, key);
+ *
+ * and a notifier makes the condition true, then calls eventcount_notify().
+ * Notifying costs a fence and a load when nobody waits.
+ */
+typedef struct eventcount {
+    _Atomic uint32_t epoch;   /* Bumped by every notification with waiters */
+    _Atomic uint32_t waiters; /* Threads between prepare_wait and the end of wait */
+} eventcount;
+
+void eventcount_init(eventcount *ec);
+
+uint32_t eventcount_prepare_wait(eventcount *ec);
+
+void eventcount_cancel_wait(eventcount *ec);
+
+void eventcount_wait(eventcount *ec, uint32_t key);
+
+int eventcount_wait_timeout(eventcount *ec, uint32_t key, uint64_t timeout_ns);
+
+void eventcount_notify(eventcount *ec, int count);
+
+void eventcount_notify_all(eventcount *ec);
+
+/**
+ * Park lot: threads park on their own slot, and unpark takes a parked
+ * thread off the lot before waking it, so every wake-up goes to exactly
+ * one thread which is really asleep. A parking thread does
+ *
+ *     park_lot_prepare(lot, slot);
+ *     if (condition) park_lot_cancel(lot, slot);
+ *     else park_slot_wait(slot);
+ *
+ * and unparking costs a fence and a load when nobody is parked.
+ */
+typedef struct park_slot {
+    _Atomic uint32_t state;     /* PARK_RUNNING or PARK_PARKED */
+    struct park_slot *next;
+} park_slot;
+
+typedef struct park_lot {
+    pthread_mutex_t mutex;      /* Protects the stack of slots */
+    park_slot *top;             /* Last parked slot, woken first as its cache is warm */
+    atomic_size_t parked;       /* Number of slots on the stack */
+} park_lot;
+
+#define PARK_RUNNING 0
+#define PARK_PARKED 1
+
+int park_lot_init(park_lot *lot);
+
+void park_lot_destroy(park_lot *lot);
+
+void park_lot_prepare(park_lot *lot, park_slot *slot);
+
+void park_lot_cancel(park_lot *lot, park_slot *slot);
+
+void park_slot_wait(park_slot *slot);
+
+int park_lot_wait_timeout(park_lot *lot, park_slot *slot, uint64_t timeout_ns);
+
+size_t park_lot_unpark(park_lot *lot, size_t count);
+
+void park_lot_unpark_all(park_lot *lot);
+
+#endif //ASYNC_PARK_H
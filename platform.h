@@ -0,0 +1,22 @@
+#ifndef ASYNC_PLATFORM_H
+#define ASYNC_PLATFORM_H
+
+/**
+ * Small platform helpers shared by the lock-free parts of the library.
+ */
+
+/* Size of a cache line, used to keep independently written fields apart */
+#define CACHE_LINE_SIZE 64
+
+#define CACHE_ALIGNED _Alignas(CACHE_LINE_SIZE)
+
+/* Hint for the CPU that the thread is spinning */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() ((void) 0)
+#endif
+
+#endif //ASYNC_PLATFORM_H
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+#include "platform.h"
+
+typedef struct ring_cell {
+    _Atomic size_t seq;
+    unsigned char data[];
+} ring_cell;
+
+static inline ring_cell *ring_cell_at(ring *ring_p, size_t pos) {
+    return (ring_cell *) (ring_p->cells + (pos & ring_p->mask) * ring_p->cell_size);
+}
+
+/**
+ * Initializes an empty ring.
+ * @param ring_p    - pointer to the ring.
+ * @param capacity  - number of elements, rounded up to a power of two.
+ * @param elem_size - size of a single element.
+ * @return 0 on success, otherwise -1.
+ */
+int ring_init(ring *ring_p, size_t capacity, size_t elem_size) {
+    size_t size = 2;
+
+    while (size < capacity)
+        size *= 2;
+
+    size_t cell_size = sizeof(ring_cell) + elem_size;
+    cell_size = (cell_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+    ring_p->cells = aligned_alloc(CACHE_LINE_SIZE, size * cell_size);
+
+    if (ring_p->cells == NULL) {
+        fprintf(stderr, "ring_init(): Malloc failed for ring cells.\n");
+        return -1;
+    }
+
+    ring_p->mask = size - 1;
+    ring_p->elem_size = elem_size;
+    ring_p->cell_size = cell_size;
+
+    for (size_t i = 0; i < size; ++i) {
+        atomic_init(&ring_cell_at(ring_p, i)->seq, i);
+    }
+
+    atomic_init(&ring_p->enqueue_pos, 0);
+    atomic_init(&ring_p->dequeue_pos, 0);
+
+    return 0;
+}
+
+void ring_destroy(ring *ring_p) {
+    free(ring_p->cells);
+    ring_p->cells = NULL;
+}
+
+/**
+ * Copies the element into the ring.
+ * @return 0 on success, -1 if the ring is full.
+ */
+int ring_push(ring *ring_p, const void *elem) {
+    size_t pos = atomic_load_explicit(&ring_p->enqueue_pos, memory_order_relaxed);
+    ring_cell *cell;
+
+    for (;;) {
+        cell = ring_cell_at(ring_p, pos);
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t) seq - (ptrdiff_t) pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_p->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring_p->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    memcpy(cell->data, elem, ring_p->elem_size);
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    return 0;
+}
+
+/**
+ * Copies n consecutive elements into the ring, reserving their cells
+ * with a single CAS. Either all of them are pushed or none.
+ * @param ring_p - pointer to the ring.
+ * @param elems  - array of n elements.
+ * @param n      - number of elements, at most the capacity of the ring.
+ * @return 0 on success, -1 if there is no room for n elements.
+ */
+int ring_push_bulk(ring *ring_p, const void *elems, size_t n) {
+    if (n == 0)
+        return 0;
+
+    if (n > ring_p->mask + 1)
+        return -1;
+
+    size_t pos = atomic_load_explicit(&ring_p->enqueue_pos, memory_order_relaxed);
+
+    for (;;) {
+        /* If the last cell is free in this lap, consumers have reserved every cell before it */
+        size_t last = pos + n - 1;
+        size_t seq = atomic_load_explicit(&ring_cell_at(ring_p, last)->seq, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t) seq - (ptrdiff_t) last;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_p->enqueue_pos, &pos, pos + n,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring_p->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    const unsigned char *elem = elems;
+
+    for (size_t i = 0; i < n; ++i, elem += ring_p->elem_size) {
+        ring_cell *cell = ring_cell_at(ring_p, pos + i);
+
+        /* A consumer may still be copying out the previous element of the cell */
+        while (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + i)
+            cpu_relax();
+
+        memcpy(cell->data, elem, ring_p->elem_size);
+        atomic_store_explicit(&cell->seq, pos + i + 1, memory_order_release);
+    }
+
+    return 0;
+}
+
+/**
+ * Copies the oldest element out of the ring.
+ * @return 0 on success, -1 if the ring is empty.
+ */
+int ring_pop(ring *ring_p, void *elem) {
+    size_t pos = atomic_load_explicit(&ring_p->dequeue_pos, memory_order_relaxed);
+    ring_cell *cell;
+
+    for (;;) {
+        cell = ring_cell_at(ring_p, pos);
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t) seq - (ptrdiff_t) (pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_p->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring_p->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    memcpy(elem, cell->data, ring_p->elem_size);
+    atomic_store_explicit(&cell->seq, pos + ring_p->mask + 1, memory_order_release);
+
+    return 0;
+}
+
+/* Approximate number of elements in the ring */
+size_t ring_size(ring *ring_p) {
+    size_t dequeue_pos = atomic_load_explicit(&ring_p->dequeue_pos, memory_order_relaxed);
+    size_t enqueue_pos = atomic_load_explicit(&ring_p->enqueue_pos, memory_order_relaxed);
+
+    return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+}
+
+size_t ring_capacity(ring *ring_p) {
+    return ring_p->mask + 1;
+}
@@ -0,0 +1,37 @@
+#ifndef ASYNC_RING_H
+#define ASYNC_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include "platform.h"
+
+/**
+ * Bounded lock-free multi-producer multi-consumer queue
+ * (D. Vyukov's array queue with per-cell sequence numbers).
+ * Elements of a fixed size are copied in and out by value.
+ */
+
+typedef struct ring {
+    CACHE_ALIGNED _Atomic size_t enqueue_pos; /* Next cell to be written by producers */
+    CACHE_ALIGNED _Atomic size_t dequeue_pos; /* Next cell to be read by consumers */
+    CACHE_ALIGNED unsigned char *cells;       /* Sequence number followed by the element */
+    size_t mask;                              /* Capacity - 1, capacity is a power of two */
+    size_t elem_size;
+    size_t cell_size;                         /* Multiple of the cache line size */
+} ring;
+
+int ring_init(ring *ring_p, size_t capacity, size_t elem_size);
+
+void ring_destroy(ring *ring_p);
+
+int ring_push(ring *ring_p, const void *elem);
+
+int ring_push_bulk(ring *ring_p, const void *elems, size_t n);
+
+int ring_pop(ring *ring_p, void *elem);
+
+size_t ring_capacity(ring *ring_p);
+
+size_t ring_size(ring *ring_p);
+
+#endif //ASYNC_RING_H
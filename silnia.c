@@ -22,29 +22,7 @@ void *inside_callable(void *arg, size_t argsz __attribute__ ((unused)), size_t *
     return n;
 }
 
-void *start_callable(void *arg, size_t argsz __attribute__ ((unused)), size_t *resultSz __attribute__ ((unused))) {
-    myJob **jobs = arg;
-    long long **results = malloc(NO_THREADS * sizeof(long long *));
-    future_t *futures[NO_THREADS];
-
-    for (size_t i = 0; i < NO_THREADS; i++) {
-        myJob *job = jobs[i];
-        future_t *new_future = malloc(sizeof(future_t));
-        async(job->pool, new_future, (callable_t) {.function = inside_callable, .arg = job, .argsz = sizeof(myJob)});
-        futures[i] = new_future;
-    }
-
-    for (size_t j = 0; j < NO_THREADS; ++j) {
-        results[j] = (long long *) await(futures[j]);
-    }
-
-    for (size_t i = 0; i < NO_THREADS; ++i) {
-        free(futures[i]);
-    }
-
-    return results;
-}
-
+/* Multiplies the partial products, gets them all at once from when_all() */
 void *result_callable(void *arg, size_t argsz __attribute__ ((unused)), size_t *resultSz __attribute__ ((unused))) {
     long long **results = arg;
     long long *ans = malloc(sizeof(long long));
@@ -82,33 +60,28 @@ int main() {
             continue;
         }
 
-        myJob *jobs[NO_THREADS];
-        future_t new_future;
+        myJob jobs[NO_THREADS];
+        callable_t callables[NO_THREADS];
+        future_t partial[NO_THREADS];
 
         for (long long i = 1; i <= NO_THREADS; i++) {
-            myJob *new_job = malloc(sizeof(myJob));
-            new_job->start = i;
-            new_job->number = n;
-            new_job->pool = &pool;
-
-            jobs[i - 1] = new_job;
+            jobs[i - 1] = (myJob) {.start = i, .number = n, .pool = &pool};
+            callables[i - 1] = (callable_t) {.function = inside_callable, .arg = &jobs[i - 1], .argsz = sizeof(myJob)};
         }
 
-        async(&pool, &new_future,
-              (callable_t) {.function = start_callable, .arg = jobs, .argsz = NO_THREADS * sizeof(myJob *)});
-
+        /* No thread waits for the partial products, the last one done schedules the map */
+        future_t all_future;
         future_t result_future;
 
-        map(&pool, &result_future, &new_future, result_callable);
+        async_bulk(&pool, partial, callables, NO_THREADS);
+        when_all(&pool, &all_future, partial, NO_THREADS);
+        map(&pool, &result_future, &all_future, result_callable);
 
         long long *ans = await(&result_future);
 
         printf("%lld\n", *ans);
 
         free(ans);
-        for (size_t i = 0; i < NO_THREADS; ++i) {
-            free(jobs[i]);
-        }
     }
 
     thread_pool_destroy(&pool);
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+#define NEXT(block) (*(void **) (block))
+
+/**
+ * Initializes the slab.
+ * @param slab_p     - pointer to the slab.
+ * @param block_size - size of a block, at least the size of a pointer.
+ * @param num_caches - number of the per thread caches.
+ * @param prealloc   - number of blocks allocated up front.
+ * @return 0 on success, otherwise -1.
+ */
+int slab_init(slab *slab_p, size_t block_size, size_t num_caches, size_t prealloc) {
+    if (block_size < sizeof(void *))
+        block_size = sizeof(void *);
+
+    slab_p->block_size = block_size;
+    slab_p->num_caches = num_caches;
+    slab_p->depot = NULL;
+    slab_p->depot_count = 0;
+    slab_p->shared_hits = 0;
+    slab_p->shared_misses = 0;
+    slab_p->chunk = NULL;
+    slab_p->chunk_blocks = 0;
+
+    slab_p->caches = aligned_alloc(CACHE_LINE_SIZE, (num_caches ? num_caches : 1) * sizeof(slab_cache));
+
+    if (slab_p->caches == NULL) {
+        fprintf(stderr, "slab_init(): Malloc failed for caches.\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < num_caches; ++i) {
+        slab_p->caches[i].free = NULL;
+        slab_p->caches[i].count = 0;
+        atomic_init(&slab_p->caches[i].hits, 0);
+        atomic_init(&slab_p->caches[i].misses, 0);
+    }
+
+    if (pthread_mutex_init(&slab_p->mutex, NULL) != 0) {
+        fprintf(stderr, "slab_init(): mutex initialisation failed.\n");
+        free(slab_p->caches);
+        return -1;
+    }
+
+    if (prealloc > 0) {
+        slab_p->chunk = malloc(prealloc * block_size);
+
+        if (slab_p->chunk == NULL) {
+            fprintf(stderr, "slab_init(): Malloc failed for preallocated blocks.\n");
+            pthread_mutex_destroy(&slab_p->mutex);
+            free(slab_p->caches);
+            return -1;
+        }
+
+        slab_p->chunk_blocks = prealloc;
+
+        for (size_t i = 0; i < prealloc; ++i) {
+            void *block = slab_p->chunk + i * block_size;
+            NEXT(block) = slab_p->depot;
+            slab_p->depot = block;
+        }
+
+        slab_p->depot_count = prealloc;
+    }
+
+    return 0;
+}
+
+static int slab_in_chunk(slab *slab_p, void *block) {
+    unsigned char *p = block;
+
+    return slab_p->chunk != NULL && p >= slab_p->chunk &&
+           p < slab_p->chunk + slab_p->chunk_blocks * slab_p->block_size;
+}
+
+static void slab_release_list(slab *slab_p, void *block) {
+    while (block != NULL) {
+        void *next = NEXT(block);
+
+        if (!slab_in_chunk(slab_p, block))
+            free(block);
+
+        block = next;
+    }
+}
+
+/* Frees every free block, blocks still in use are not tracked */
+void slab_destroy(slab *slab_p) {
+    for (size_t i = 0; i < slab_p->num_caches; ++i) {
+        slab_release_list(slab_p, slab_p->caches[i].free);
+    }
+
+    slab_release_list(slab_p, slab_p->depot);
+
+    free(slab_p->chunk);
+    free(slab_p->caches);
+    pthread_mutex_destroy(&slab_p->mutex);
+}
+
+static void counter_inc(atomic_size_t *counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+/**
+ * Allocates a block.
+ * @param slab_p - pointer to the slab.
+ * @param cache  - index of the cache of the calling thread, or SLAB_SHARED.
+ * @return pointer to the block, NULL if malloc failed.
+ */
+void *slab_alloc(slab *slab_p, size_t cache) {
+    void *block;
+
+    if (cache == SLAB_SHARED) {
+        pthread_mutex_lock(&slab_p->mutex);
+
+        if ((block = slab_p->depot) != NULL) {
+            slab_p->depot = NEXT(block);
+            slab_p->depot_count -= 1;
+            slab_p->shared_hits += 1;
+        } else {
+            slab_p->shared_misses += 1;
+        }
+
+        pthread_mutex_unlock(&slab_p->mutex);
+
+        return block != NULL ? block : malloc(slab_p->block_size);
+    }
+
+    slab_cache *cache_p = &slab_p->caches[cache];
+
+    if (cache_p->free == NULL) {
+        /* Refill the cache with a batch from the depot */
+        pthread_mutex_lock(&slab_p->mutex);
+
+        while (slab_p->depot != NULL && cache_p->count < SLAB_BATCH) {
+            block = slab_p->depot;
+            slab_p->depot = NEXT(block);
+            NEXT(block) = cache_p->free;
+            cache_p->free = block;
+            cache_p->count += 1;
+        }
+
+        slab_p->depot_count -= cache_p->count;
+
+        pthread_mutex_unlock(&slab_p->mutex);
+    }
+
+    if ((block = cache_p->free) != NULL) {
+        cache_p->free = NEXT(block);
+        cache_p->count -= 1;
+        counter_inc(&cache_p->hits);
+
+        return block;
+    }
+
+    counter_inc(&cache_p->misses);
+
+    return malloc(slab_p->block_size);
+}
+
+/**
+ * Returns a block to the slab. A block may be freed by another thread
+ * than the one which allocated it; a cache which grew too big gives
+ * a batch of blocks back to the depot.
+ * @param slab_p - pointer to the slab.
+ * @param cache  - index of the cache of the calling thread, or SLAB_SHARED.
+ * @param block  - pointer to the block.
+ */
+void slab_free(slab *slab_p, size_t cache, void *block) {
+    if (cache == SLAB_SHARED) {
+        pthread_mutex_lock(&slab_p->mutex);
+        NEXT(block) = slab_p->depot;
+        slab_p->depot = block;
+        slab_p->depot_count += 1;
+        pthread_mutex_unlock(&slab_p->mutex);
+        return;
+    }
+
+    slab_cache *cache_p = &slab_p->caches[cache];
+
+    NEXT(block) = cache_p->free;
+    cache_p->free = block;
+    cache_p->count += 1;
+
+    if (cache_p->count < 2 * SLAB_BATCH)
+        return;
+
+    /* Detach a batch from the cache before taking the lock */
+    void *first = cache_p->free;
+    void *last = first;
+
+    for (size_t i = 1; i < SLAB_BATCH; ++i)
+        last = NEXT(last);
+
+    cache_p->free = NEXT(last);
+    cache_p->count -= SLAB_BATCH;
+
+    pthread_mutex_lock(&slab_p->mutex);
+    NEXT(last) = slab_p->depot;
+    slab_p->depot = first;
+    slab_p->depot_count += SLAB_BATCH;
+    pthread_mutex_unlock(&slab_p->mutex);
+}
+
+/**
+ * Sums allocations served with a free block (hits) and with malloc (misses).
+ */
+void slab_stats(slab *slab_p, size_t *hits, size_t *misses) {
+    pthread_mutex_lock(&slab_p->mutex);
+    *hits = slab_p->shared_hits;
+    *misses = slab_p->shared_misses;
+    pthread_mutex_unlock(&slab_p->mutex);
+
+    for (size_t i = 0; i < slab_p->num_caches; ++i) {
+        *hits += atomic_load_explicit(&slab_p->caches[i].hits, memory_order_relaxed);
+        *misses += atomic_load_explicit(&slab_p->caches[i].misses, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef ASYNC_SLAB_H
+#define ASYNC_SLAB_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include "platform.h"
+
+/**
+ * Free-list allocator of fixed-size blocks.
+ * Each thread of a thread pool has its own cache of free blocks, used
+ * without any synchronization. Caches exchange blocks with a shared depot
+ * in batches, threads without a cache use the depot directly.
+ * When there is no free block, a new one is malloc-ed.
+ */
+
+#define SLAB_BATCH 32
+
+/* Cache index of threads which have no cache of their own */
+#define SLAB_SHARED ((size_t) -1)
+
+typedef struct slab_cache {
+    CACHE_ALIGNED void *free; /* Free blocks linked through their first word */
+    size_t count;
+    atomic_size_t hits;       /* Written by the owner only */
+    atomic_size_t misses;
+} slab_cache;
+
+typedef struct slab {
+    size_t block_size;
+    size_t num_caches;
+    slab_cache *caches;
+    pthread_mutex_t mutex;    /* Protects the depot and the shared counters */
+    void *depot;
+    size_t depot_count;
+    size_t shared_hits;
+    size_t shared_misses;
+    unsigned char *chunk;     /* Preallocated blocks, freed as a whole */
+    size_t chunk_blocks;
+} slab;
+
+int slab_init(slab *slab_p, size_t block_size, size_t num_caches, size_t prealloc);
+
+void slab_destroy(slab *slab_p);
+
+void *slab_alloc(slab *slab_p, size_t cache);
+
+void slab_free(slab *slab_p, size_t cache, void *block);
+
+void slab_stats(slab *slab_p, size_t *hits, size_t *misses);
+
+#endif //ASYNC_SLAB_H
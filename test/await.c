@@ -1,6 +1,8 @@
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "future.h"
 #include "minunit.h"
@@ -32,8 +34,249 @@ static char *test_await_simple() {
   return 0;
 }
 
+#define NFUTURES 100
+
+static char *test_async_bulk() {
+  thread_pool_init(&pool, 2);
+
+  int n[NFUTURES];
+  future_t futures[NFUTURES];
+  callable_t callables[NFUTURES];
+
+  for (int i = 0; i < NFUTURES; ++i) {
+    n[i] = i;
+    callables[i] =
+        (callable_t){.function = squared, .arg = &n[i], .argsz = sizeof(int)};
+  }
+
+  mu_assert("async_bulk failed",
+            async_bulk(&pool, futures, callables, NFUTURES) == 0);
+
+  for (int i = 0; i < NFUTURES; ++i) {
+    int *m = await(&futures[i]);
+    mu_assert("expected i * i", *m == i * i);
+    free(m);
+  }
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_inline_args() {
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 2);
+  options.inline_args = true;
+  thread_pool_init_ex(&pool, &options);
+
+  future_t futures[NFUTURES];
+  int n;
+
+  /* Every callable gets its own copy of n, which is overwritten at once */
+  for (n = 0; n < NFUTURES; ++n) {
+    async(&pool, &futures[n],
+          (callable_t){.function = squared, .arg = &n, .argsz = sizeof(int)});
+  }
+
+  for (int i = 0; i < NFUTURES; ++i) {
+    int *m = await(&futures[i]);
+    mu_assert("expected i * i", *m == i * i);
+    free(m);
+  }
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_task_group() {
+  thread_pool_init(&pool, 2);
+
+  int n[NFUTURES];
+  void *results[NFUTURES];
+  task_group_t group;
+
+  task_group_init(&group, &pool, results, NFUTURES);
+
+  for (int i = 0; i < NFUTURES; ++i) {
+    n[i] = i;
+    mu_assert("task_group_run failed",
+              task_group_run(&group, (callable_t){.function = squared, .arg = &n[i],
+                                                  .argsz = sizeof(int)}) == 0);
+  }
+
+  mu_assert("expected no more tasks than results",
+            task_group_run(&group, (callable_t){.function = squared, .arg = &n[0]}) == -1);
+  mu_assert("expected the failed run to take no index",
+            atomic_load(&group.runs) == NFUTURES);
+  mu_assert("task_group_wait failed", task_group_wait(&group) == 0);
+
+  for (int i = 0; i < NFUTURES; ++i) {
+    mu_assert("expected i * i", *(int *)results[i] == i * i);
+    free(results[i]);
+  }
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+#define FIB 20
+
+/* Each call runs a group of two nested calls and waits for them, as fork-join code does */
+static void *fib(void *arg, size_t argsz __attribute__((unused)),
+                 size_t *retsz __attribute__((unused))) {
+  long n = (long)arg;
+
+  if (n < 2)
+    return (void *)n;
+
+  void *results[2];
+  task_group_t group;
+
+  task_group_init(&group, &pool, results, 2);
+  task_group_run(&group, (callable_t){.function = fib, .arg = (void *)(n - 1)});
+  task_group_run(&group, (callable_t){.function = fib, .arg = (void *)(n - 2)});
+  task_group_wait(&group);
+
+  return (void *)((long)results[0] + (long)results[1]);
+}
+
+static char *test_task_group_nested() {
+  /* A single thread runs the nested groups instead of waiting for itself */
+  thread_pool_init(&pool, 1);
+
+  future_t result;
+  async(&pool, &result, (callable_t){.function = fib, .arg = (void *)FIB});
+  mu_assert("expected fib(20)", (long)await(&result) == 6765);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static atomic_int gate;
+
+static void *gated(void *arg, size_t argsz, size_t *retsz) {
+  while (!atomic_load(&gate))
+    ;
+  return squared(arg, argsz, retsz);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static char *test_await_timeout() {
+  thread_pool_init(&pool, 1);
+
+  int n = 5;
+  void *out = NULL;
+  cancel_token_t token;
+  future_t queued;
+
+  cancel_token_init(&token);
+  atomic_store(&gate, 0);
+  async(&pool, &future,
+        (callable_t){.function = gated, .arg = &n, .argsz = sizeof(int)});
+  async(&pool, &queued, (callable_t){.function = squared, .arg = &n,
+                                     .argsz = sizeof(int), .token = &token});
+
+  mu_assert("expected a pending future", !future_is_ready(&future));
+  mu_assert("expected EAGAIN from try_get",
+            future_try_get(&future, &out) == -1 && errno == EAGAIN);
+
+  uint64_t start = now_ns();
+  mu_assert("expected ETIMEDOUT",
+            await_timeout(&future, 2000000, &out) == -1 && errno == ETIMEDOUT);
+  mu_assert("expected to wait for the timeout", now_ns() - start >= 2000000);
+
+  /* The queued task is cancelled while the only thread is still busy */
+  cancel_token_cancel(&token);
+  atomic_store(&gate, 1);
+  mu_assert("expected the result in time",
+            await_timeout(&future, 1000000000, &out) == 0 && *(int *)out == 25);
+  free(out);
+
+  /* Destroying a pending future waits for its task, which is skipped */
+  future_destroy(&queued);
+  mu_assert("expected a done future", future_is_ready(&queued));
+  mu_assert("expected the cancelled result",
+            future_try_get(&queued, &out) == 0 && out == NULL);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_failed_submit() {
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 1);
+  options.max_queued = 4;
+  options.on_full = THREAD_POOL_FULL_TIMEOUT;
+  options.full_timeout_ns = 1000000;
+  thread_pool_init_ex(&pool, &options);
+
+  int n = 3;
+  future_t futures[8];
+  callable_t callables[8];
+  for (int i = 0; i < 8; ++i)
+    callables[i] = (callable_t){.function = squared, .arg = &n, .argsz = sizeof(int)};
+
+  atomic_store(&gate, 0);
+  async(&pool, &future,
+        (callable_t){.function = gated, .arg = &n, .argsz = sizeof(int)});
+
+  /* Failed submissions leave their futures done, so waiting for them returns */
+  mu_assert("expected a batch over the bound to fail",
+            async_bulk(&pool, futures, callables, 8) == -1);
+  for (int i = 0; i < 8; ++i) {
+    mu_assert("expected a cancelled future", future_is_cancelled(&futures[i]));
+    mu_assert("expected no result", await(&futures[i]) == NULL);
+  }
+
+  int queued = 0;
+  while (queued < 8 && async(&pool, &futures[queued], callables[queued]) == 0)
+    ++queued;
+
+  mu_assert("expected the pool to fill up", queued < 8);
+  future_destroy(&futures[queued]);
+  mu_assert("expected the failed future to be cancelled",
+            future_is_cancelled(&futures[queued]));
+
+  atomic_store(&gate, 1);
+  free(await(&future));
+  for (int i = 0; i < queued; ++i)
+    free(await(&futures[i]));
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_null_pool() {
+  int n = 3;
+  callable_t callable = {.function = squared, .arg = &n, .argsz = sizeof(int)};
+  future_t futures[2];
+  callable_t callables[2] = {callable, callable};
+
+  mu_assert("expected async on no pool to fail",
+            async(NULL, &future, callable) == -1);
+  mu_assert("expected a cancelled future", future_is_cancelled(&future));
+  mu_assert("expected no result", await(&future) == NULL);
+
+  mu_assert("expected async_bulk on no pool to fail",
+            async_bulk(NULL, futures, callables, 2) == -1);
+  mu_assert("expected cancelled futures", future_is_cancelled(&futures[0]) &&
+                                              future_is_cancelled(&futures[1]));
+  return 0;
+}
+
 static char *all_tests() {
   mu_run_test(test_await_simple);
+  mu_run_test(test_async_bulk);
+  mu_run_test(test_inline_args);
+  mu_run_test(test_task_group);
+  mu_run_test(test_task_group_nested);
+  mu_run_test(test_await_timeout);
+  mu_run_test(test_failed_submit);
+  mu_run_test(test_null_pool);
   return 0;
 }
 
@@ -1,10 +1,18 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "minunit.h"
+#include "slab.h"
 #include "threadpool.h"
+#include "timer.h"
 
 int tests_run = 0;
 
@@ -50,8 +58,596 @@ static char *ping_pong() {
   return 0;
 }
 
+#define NJOBS 10000
+
+static atomic_int counter;
+
+static void count(void *args, size_t argsz __attribute__((unused))) {
+  if (atomic_fetch_add(&counter, 1) + 1 == NJOBS)
+    sem_post(args);
+}
+
+static void wait_sem(void *args, size_t argsz __attribute__((unused))) {
+  sem_t *started = args;
+  sem_t *blocker = (sem_t *)args + 1;
+
+  sem_post(started);
+  sem_wait(blocker);
+}
+
+static char *ring_block() {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 2);
+  options.queue = THREAD_POOL_QUEUE_RING;
+  options.queue_capacity = 4;
+
+  thread_pool_init_ex(&pool, &options);
+
+  sem_t done;
+  sem_init(&done, 0, 0);
+  atomic_store(&counter, 0);
+
+  runnable_t runnables[NJOBS / 2];
+  for (int i = 0; i < NJOBS / 2; ++i) {
+    runnables[i] = (runnable_t){
+        .function = count, .arg = &done, .argsz = sizeof(sem_t)};
+    mu_assert("defer on ring failed", defer(&pool, runnables[i]) == 0);
+  }
+
+  /* Batch bigger than the ring is pushed in chunks */
+  mu_assert("defer_bulk on ring failed",
+            defer_bulk(&pool, runnables, NJOBS / 2) == 0);
+
+  sem_wait(&done);
+  mu_assert("expected every job to run", atomic_load(&counter) == NJOBS);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&done);
+  return 0;
+}
+
+static char *ring_full_error() {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 1);
+  options.queue = THREAD_POOL_QUEUE_RING;
+  options.queue_capacity = 2;
+  options.on_full = THREAD_POOL_FULL_ERROR;
+
+  thread_pool_init_ex(&pool, &options);
+
+  sem_t sems[2];
+  sem_init(&sems[0], 0, 0);
+  sem_init(&sems[1], 0, 0);
+  runnable_t block = {
+      .function = wait_sem, .arg = sems, .argsz = sizeof(sem_t) * 2};
+
+  /* Keep the only worker busy, then fill the ring */
+  defer(&pool, block);
+  sem_wait(&sems[0]);
+
+  int accepted = 0;
+  while (defer(&pool, block) == 0)
+    accepted++;
+
+  mu_assert("expected EAGAIN on a full ring", errno == EAGAIN);
+  mu_assert("expected the ring to hold 2 jobs", accepted == 2);
+
+  for (int i = 0; i <= accepted; ++i)
+    sem_post(&sems[1]);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&sems[0]);
+  sem_destroy(&sems[1]);
+  return 0;
+}
+
+#define NLOW 8
+#define NNORMAL 32
+
+static char order[NLOW + NNORMAL + 1];
+static atomic_int ran;
+
+static void record(void *args, size_t argsz __attribute__((unused))) {
+  order[atomic_fetch_add(&ran, 1)] = *(char *)args;
+}
+
+static char *priorities() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+
+  sem_t sems[2];
+  sem_init(&sems[0], 0, 0);
+  sem_init(&sems[1], 0, 0);
+  atomic_store(&ran, 0);
+
+  /* Queue up the jobs while the only worker is busy */
+  defer(&pool, (runnable_t){
+      .function = wait_sem, .arg = sems, .argsz = sizeof(sem_t) * 2});
+  sem_wait(&sems[0]);
+
+  static char low = 'L', normal = 'N', high = 'H';
+
+  for (int i = 0; i < NLOW; ++i)
+    defer_prio(&pool, (runnable_t){.function = record, .arg = &low},
+               THREAD_POOL_PRIO_LOW);
+  for (int i = 0; i < NNORMAL; ++i)
+    defer(&pool, (runnable_t){.function = record, .arg = &normal});
+  defer_prio(&pool, (runnable_t){.function = record, .arg = &high},
+             THREAD_POOL_PRIO_HIGH);
+
+  sem_post(&sems[1]);
+  thread_pool_wait_idle(&pool);
+
+  /* One of the first jobs may be a low one taken on aging */
+  mu_assert("expected the high job to run first",
+            order[0] == 'H' || order[1] == 'H');
+
+  int aged = 0;
+  for (int i = 0; i <= THREAD_POOL_AGING_ROUNDS; ++i)
+    aged |= order[i] == 'L';
+
+  mu_assert("expected a low job to run on aging", aged);
+  mu_assert("expected a low job to run last",
+            order[NLOW + NNORMAL] == 'L');
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&sems[0]);
+  sem_destroy(&sems[1]);
+  return 0;
+}
+
+static thread_pool_t *blocked_pool;
+
+/* Releases the blocker once the producer blocked, however slowly it got there */
+static void *release_later(void *args) {
+  struct timespec delay = {.tv_sec = 0, .tv_nsec = 100000};
+  thread_pool_stats_t stats;
+
+  do {
+    nanosleep(&delay, NULL);
+    thread_pool_stats(blocked_pool, &stats);
+  } while (stats.submits_blocked == 0);
+
+  sem_post(args);
+  return NULL;
+}
+
+static char *bounded_list() {
+  thread_pool_full policies[] = {THREAD_POOL_FULL_ERROR, THREAD_POOL_FULL_TIMEOUT,
+                                 THREAD_POOL_FULL_CALLER_RUNS, THREAD_POOL_FULL_BLOCK};
+
+  for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); ++p) {
+    thread_pool_t pool;
+    thread_pool_options_t options;
+    thread_pool_options_init(&options, 1);
+    options.max_queued = 2;
+    options.on_full = policies[p];
+    options.full_timeout_ns = 1000000;
+    thread_pool_init_ex(&pool, &options);
+
+    sem_t sems[2];
+    sem_init(&sems[0], 0, 0);
+    sem_init(&sems[1], 0, 0);
+    runnable_t block = {
+        .function = wait_sem, .arg = sems, .argsz = sizeof(sem_t) * 2};
+    runnable_t counted = {.function = count, .arg = NULL};
+
+    /* Keep the only worker busy, then fill the list */
+    defer(&pool, block);
+    sem_wait(&sems[0]);
+    atomic_store(&counter, 0);
+    mu_assert("expected room for 2 jobs",
+              defer(&pool, counted) == 0 && defer(&pool, counted) == 0);
+
+    pthread_t releaser;
+    blocked_pool = &pool;
+    if (policies[p] == THREAD_POOL_FULL_BLOCK)
+      pthread_create(&releaser, NULL, release_later, &sems[1]);
+
+    int ret = defer(&pool, counted);
+    thread_pool_stats_t stats;
+    thread_pool_stats(&pool, &stats);
+
+    switch (policies[p]) {
+    case THREAD_POOL_FULL_ERROR:
+      mu_assert("expected EAGAIN", ret == -1 && errno == EAGAIN);
+      mu_assert("expected a rejection", stats.submits_rejected == 1);
+      break;
+    case THREAD_POOL_FULL_TIMEOUT:
+      mu_assert("expected ETIMEDOUT", ret == -1 && errno == ETIMEDOUT);
+      mu_assert("expected a rejection after blocking",
+                stats.submits_rejected == 1 && stats.submits_blocked == 1);
+      break;
+    case THREAD_POOL_FULL_CALLER_RUNS:
+      mu_assert("expected the job to run at once",
+                ret == 0 && atomic_load(&counter) == 1);
+      mu_assert("expected a job run by the caller", stats.submits_caller_ran == 1);
+      break;
+    default:
+      pthread_join(releaser, NULL);
+      mu_assert("expected the job to wait for room",
+                ret == 0 && stats.submits_blocked == 1);
+    }
+
+    if (policies[p] != THREAD_POOL_FULL_BLOCK)
+      sem_post(&sems[1]);
+
+    thread_pool_destroy(&pool);
+    sem_destroy(&sems[0]);
+    sem_destroy(&sems[1]);
+  }
+  return 0;
+}
+
+static char *bounded_bulk() {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 1);
+  options.max_queued = 4;
+  options.on_full = THREAD_POOL_FULL_TIMEOUT;
+  options.full_timeout_ns = 1000000;
+  thread_pool_init_ex(&pool, &options);
+
+  sem_t sems[2];
+  sem_init(&sems[0], 0, 0);
+  sem_init(&sems[1], 0, 0);
+  runnable_t block = {
+      .function = wait_sem, .arg = sems, .argsz = sizeof(sem_t) * 2};
+  runnable_t counted[8];
+  for (int i = 0; i < 8; ++i)
+    counted[i] = (runnable_t){.function = count, .arg = NULL};
+
+  defer(&pool, block);
+  sem_wait(&sems[0]);
+  atomic_store(&counter, 0);
+
+  /* A batch which never fits is rejected before any of it is queued */
+  mu_assert("expected EAGAIN for a batch over the bound",
+            defer_bulk(&pool, counted, 8) == -1 && errno == EAGAIN);
+
+  /* Every level shares the bound */
+  mu_assert("expected room for 4 jobs",
+            defer_prio(&pool, counted[0], THREAD_POOL_PRIO_HIGH) == 0 &&
+                defer_prio(&pool, counted[0], THREAD_POOL_PRIO_LOW) == 0 &&
+                defer_bulk(&pool, counted, 2) == 0);
+  mu_assert("expected a full pool",
+            defer_prio(&pool, counted[0], THREAD_POOL_PRIO_HIGH) == -1 &&
+                errno == ETIMEDOUT);
+  mu_assert("expected no room for a batch",
+            defer_bulk(&pool, counted, 2) == -1 && errno == ETIMEDOUT);
+
+  sem_post(&sems[1]);
+  thread_pool_wait_idle(&pool);
+  mu_assert("expected only the jobs queued to run", atomic_load(&counter) == 4);
+
+  thread_pool_destroy(&pool);
+
+  /* Blocking batches go in parts as room frees, not once the pool is empty */
+  options.on_full = THREAD_POOL_FULL_BLOCK;
+  options.max_queued = 2;
+  thread_pool_init_ex(&pool, &options);
+  atomic_store(&counter, 0);
+
+  for (int i = 0; i < 100; ++i)
+    mu_assert("defer_bulk failed", defer_bulk(&pool, counted, 8) == 0);
+
+  thread_pool_wait_idle(&pool);
+  mu_assert("expected every job to run", atomic_load(&counter) == 800);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&sems[0]);
+  sem_destroy(&sems[1]);
+  return 0;
+}
+
+#define NTIMERS 1000
+
+static char *timer_wheel_expiry() {
+  static timer timers[NTIMERS];
+  timer_wheel wheel;
+  timer_wheel_init(&wheel, 12345);
+
+  /* Spread over every level of the wheel and beyond its range */
+  unsigned int seed = 1;
+  for (int i = 0; i < NTIMERS; ++i) {
+    timers[i].expires = 12345 + (uint64_t)rand_r(&seed) % (1ull << 26);
+    timer_wheel_add(&wheel, &timers[i]);
+  }
+
+  int expired = 0;
+  uint64_t now = 12345;
+
+  while (timer_wheel_size(&wheel) > 0) {
+    /* Jumps straight to the next tick on which something happens */
+    uint64_t next = timer_wheel_next(&wheel);
+    mu_assert("expected the next tick to be ahead", next > now);
+
+    for (int i = 0; i < NTIMERS; ++i) {
+      if (timers[i].next != &timers[i] && timers[i].expires < next &&
+          timers[i].expires > now) {
+        mu_assert("expected no timer to expire before the next tick", 0);
+      }
+    }
+
+    now = next;
+
+    for (timer *t = timer_wheel_advance(&wheel, now); t != NULL;) {
+      timer *following = t->next;
+      mu_assert("expected the timer to expire right on its tick",
+                t->expires == now);
+      t->next = t;
+      ++expired;
+      t = following;
+    }
+  }
+
+  mu_assert("expected every timer to expire", expired == NTIMERS);
+  return 0;
+}
+
+static atomic_int ticks;
+static atomic_int periodic_ticks;
+static atomic_int sequence;
+
+static void tick(void *args __attribute__((unused)),
+                 size_t argsz __attribute__((unused))) {
+  atomic_fetch_add(&ticks, 1);
+}
+
+static void periodic_tick(void *args __attribute__((unused)),
+                          size_t argsz __attribute__((unused))) {
+  atomic_fetch_add(&periodic_ticks, 1);
+}
+
+static void stamp(void *args, size_t argsz __attribute__((unused))) {
+  atomic_store((atomic_int *)args, atomic_fetch_add(&sequence, 1) + 1);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Waits up to about half a second for the counter, however loaded the machine */
+static int wait_for(atomic_int *value, int least) {
+  struct timespec delay = {.tv_sec = 0, .tv_nsec = 1000000};
+
+  for (int i = 0; i < 500 && atomic_load(value) < least; ++i)
+    nanosleep(&delay, NULL);
+
+  return atomic_load(value) >= least;
+}
+
+static char *delayed() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+  atomic_store(&ticks, 0);
+  atomic_store(&periodic_ticks, 0);
+  atomic_store(&sequence, 0);
+
+  atomic_int early = 0, late = 0;
+  uint64_t start = now_ns();
+
+  /* Scheduled in this order, late expires after early however long the thread stalls */
+  defer_after(&pool, (runnable_t){.function = stamp, .arg = &early}, 2000000);
+  defer_after(&pool, (runnable_t){.function = stamp, .arg = &late}, 20000000);
+
+  for (int i = 0; i < 100; ++i)
+    defer_after(&pool, (runnable_t){.function = tick}, 20000000);
+
+  defer_periodic(&pool, (runnable_t){.function = periodic_tick}, 5000000);
+
+  /* Waits for the delayed jobs, not for the periodic one */
+  thread_pool_wait_idle(&pool);
+
+  mu_assert("expected the delay to pass", now_ns() - start >= 20000000);
+  mu_assert("expected every delayed run", atomic_load(&ticks) == 100);
+  mu_assert("expected the shorter delay to run first",
+            atomic_load(&early) != 0 && atomic_load(&early) < atomic_load(&late));
+  mu_assert("expected the periodic job to run again",
+            wait_for(&periodic_ticks, 2));
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *delayed_full() {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 1);
+  options.max_queued = 1;
+  options.on_full = THREAD_POOL_FULL_BLOCK;
+  thread_pool_init_ex(&pool, &options);
+  atomic_store(&ticks, 0);
+
+  sem_t sems[2];
+  sem_init(&sems[0], 0, 0);
+  sem_init(&sems[1], 0, 0);
+
+  defer(&pool, (runnable_t){.function = wait_sem, .arg = sems});
+  sem_wait(&sems[0]);
+
+  /* The timer thread does not block on the full pool, it retries on the next ticks */
+  for (int i = 0; i < 10; ++i)
+    defer_after(&pool, (runnable_t){.function = tick}, 1000000);
+
+  struct timespec delay = {.tv_sec = 0, .tv_nsec = 20000000};
+  nanosleep(&delay, NULL);
+
+  /* The retries are no submissions of the user, none of them counts */
+  thread_pool_stats_t stats;
+  thread_pool_stats(&pool, &stats);
+  mu_assert("expected the retries not to count", stats.submits_rejected == 0 &&
+                                                     stats.submits_blocked == 0);
+  mu_assert("expected the delayed jobs to wait", atomic_load(&ticks) == 0);
+
+  sem_post(&sems[1]);
+  thread_pool_wait_idle(&pool);
+  mu_assert("expected every delayed run", atomic_load(&ticks) == 10);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&sems[0]);
+  sem_destroy(&sems[1]);
+  return 0;
+}
+
+static atomic_int cpus_allowed;
+
+static void count_cpus(void *args, size_t argsz __attribute__((unused))) {
+  cpu_set_t set;
+  sched_getaffinity(0, sizeof(set), &set);
+  atomic_store(&cpus_allowed, CPU_COUNT(&set));
+  sem_post(args);
+}
+
+static char *pinning() {
+  topology topo;
+  mu_assert("expected a CPU", topology_discover(&topo) == 0 && topo.num_cpus > 0);
+  mu_assert("expected the node of the first CPU to be local to itself",
+            topo.distance[topo.cpu_node[0]][topo.cpu_node[0]] ==
+                TOPOLOGY_LOCAL_DISTANCE);
+
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 2);
+  options.pin = THREAD_POOL_PIN_CPU;
+  options.numa_node = topo.cpu_node[0];
+  options.stack_size = 256 * 1024;
+  mu_assert("expected a pinned pool", thread_pool_init_ex(&pool, &options) == 0);
+
+  sem_t done;
+  sem_init(&done, 0, 0);
+  defer(&pool, (runnable_t){.function = count_cpus, .arg = &done});
+  sem_wait(&done);
+
+  mu_assert("expected the thread to run on one CPU",
+            atomic_load(&cpus_allowed) == 1);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&done);
+
+  thread_pool_options_init(&options, 1);
+  options.numa_node = TOPOLOGY_MAX_NODES - 1;
+  mu_assert("expected no pool on a node without CPUs",
+            topo.num_nodes == TOPOLOGY_MAX_NODES ||
+                thread_pool_init_ex(&pool, &options) == -1);
+
+  /* A failed init releases whatever it set up, see LeakSanitizer */
+  thread_pool_options_init(&options, 2);
+  options.stack_size = 1;
+  mu_assert("expected no pool with an invalid stack size",
+            thread_pool_init_ex(&pool, &options) == -1);
+  return 0;
+}
+
+#define NBLOCKS (3 * SLAB_BATCH)
+
+static char *slab_recycle() {
+  slab s;
+  slab_init(&s, 64, 1, SLAB_BATCH);
+
+  void *blocks[NBLOCKS];
+  size_t hits, misses;
+
+  /* The cache refills from the preallocated depot, then falls back to malloc */
+  for (int i = 0; i < NBLOCKS; ++i)
+    blocks[i] = slab_alloc(&s, 0);
+
+  slab_stats(&s, &hits, &misses);
+  mu_assert("expected the preallocated blocks to be used", hits == SLAB_BATCH);
+  mu_assert("expected malloc for the rest", misses == NBLOCKS - SLAB_BATCH);
+
+  /* Frees beyond the cache limit go to the depot, where others find them */
+  for (int i = 0; i < NBLOCKS; ++i)
+    slab_free(&s, 0, blocks[i]);
+
+  void *shared = slab_alloc(&s, SLAB_SHARED);
+  slab_stats(&s, &hits, &misses);
+  mu_assert("expected a shared hit from the depot", hits == SLAB_BATCH + 1);
+
+  slab_free(&s, SLAB_SHARED, shared);
+  slab_destroy(&s);
+  return 0;
+}
+
+#define NINDICES 100000
+
+static atomic_char visited[NINDICES];
+
+static void visit(size_t begin, size_t end, void *ctx __attribute__((unused))) {
+  for (size_t i = begin; i < end; ++i)
+    atomic_fetch_add(&visited[i], 1);
+}
+
+static char *parallel_for() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 2);
+
+  mu_assert("parallel_for failed",
+            thread_pool_parallel_for(&pool, 0, NINDICES, 0, visit, NULL) == 0);
+
+  for (int i = 0; i < NINDICES; ++i)
+    mu_assert("expected every index visited once", atomic_load(&visited[i]) == 1);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static void sum_range(size_t begin, size_t end, void *ctx __attribute__((unused)),
+                      void *acc) {
+  for (size_t i = begin; i < end; ++i)
+    *(uint64_t *)acc += i;
+}
+
+static void add(void *acc, const void *other, void *ctx __attribute__((unused))) {
+  *(uint64_t *)acc += *(const uint64_t *)other;
+}
+
+static void reduce_inside(void *args, size_t argsz __attribute__((unused))) {
+  thread_pool_t *pool = args;
+  uint64_t sum = 0;
+
+  /* The only thread of the pool takes part in the loop instead of waiting for itself */
+  thread_pool_parallel_reduce(pool, 0, NINDICES, 16, sum_range, add, &sum,
+                              sizeof(sum), NULL);
+  atomic_store(&counter, sum == (uint64_t)NINDICES * (NINDICES - 1) / 2);
+}
+
+static char *parallel_reduce() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+
+  atomic_store(&counter, 0);
+  defer(&pool, (runnable_t){.function = reduce_inside, .arg = &pool});
+  thread_pool_wait_idle(&pool);
+  mu_assert("expected the sum of the indices", atomic_load(&counter) == 1);
+
+  char big[THREAD_POOL_REDUCE_VALUE_SIZE + 1];
+  mu_assert("expected too big a value to fail",
+            thread_pool_parallel_reduce(&pool, 0, 1, 0, sum_range, add, big,
+                                        sizeof(big), NULL) == -1);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
 static char *all_tests() {
   mu_run_test(ping_pong);
+  mu_run_test(ring_block);
+  mu_run_test(ring_full_error);
+  mu_run_test(bounded_list);
+  mu_run_test(bounded_bulk);
+  mu_run_test(priorities);
+  mu_run_test(timer_wheel_expiry);
+  mu_run_test(delayed);
+  mu_run_test(delayed_full);
+  mu_run_test(pinning);
+  mu_run_test(slab_recycle);
+  mu_run_test(parallel_for);
+  mu_run_test(parallel_reduce);
   return 0;
 }
 
@@ -0,0 +1,56 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "future.h"
+#include "minunit.h"
+
+int tests_run = 0;
+static thread_pool_t pool;
+static future_t future;
+
+#define DEPTH 100
+
+/* Every level waits for the next one from inside of the only thread of the pool */
+static void *nested(void *arg, size_t argsz __attribute__((unused)),
+                    size_t *retsz __attribute__((unused))) {
+  intptr_t depth = (intptr_t)arg;
+
+  if (depth == 0)
+    return NULL;
+
+  future_t child;
+  async(&pool, &child,
+        (callable_t){.function = nested, .arg = (void *)(depth - 1), .argsz = 0});
+
+  return (void *)((intptr_t)await(&child) + 1);
+}
+
+static char *test_nested_await() {
+  thread_pool_init(&pool, 1);
+
+  async(&pool, &future,
+        (callable_t){.function = nested, .arg = (void *)DEPTH, .argsz = 0});
+
+  mu_assert("expected DEPTH", (intptr_t)await(&future) == DEPTH);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_nested_await);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ " %s\n", result);
+  } else {
+    printf(__FILE__ " ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
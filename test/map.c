@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "future.h"
+#include "minunit.h"
+
+int tests_run = 0;
+static thread_pool_t pool;
+
+static void *squared(void *arg, size_t argsz __attribute__((unused)),
+                     size_t *retsz __attribute__((unused))) {
+  int n = *(int *)arg;
+  int *ret = malloc(sizeof(int));
+  *ret = n * n;
+  return ret;
+}
+
+#define NMAPS 100000
+
+static void *increment(void *arg, size_t argsz __attribute__((unused)),
+                       size_t *retsz __attribute__((unused))) {
+  int *n = arg;
+  *n += 1;
+  return n;
+}
+
+static char *test_map_chain() {
+  thread_pool_init(&pool, 2);
+
+  future_t *futures = malloc((NMAPS + 1) * sizeof(future_t));
+  int n = 0;
+
+  /* Most maps are registered before the first future is done */
+  async(&pool, &futures[0],
+        (callable_t){.function = squared, .arg = &n, .argsz = sizeof(int)});
+
+  for (int i = 0; i < NMAPS; ++i)
+    mu_assert("map failed", map(&pool, &futures[i + 1], &futures[i], increment) == 0);
+
+  int *m = await(&futures[NMAPS]);
+  mu_assert("expected NMAPS", *m == NMAPS);
+  free(m);
+
+  thread_pool_destroy(&pool);
+  free(futures);
+  return 0;
+}
+
+#define NWHEN 1000
+
+static void *sum(void *arg, size_t argsz, size_t *retsz __attribute__((unused))) {
+  int **results = arg;
+  int *ret = malloc(sizeof(int));
+  *ret = 0;
+  for (size_t i = 0; i < argsz / sizeof(int *); ++i) {
+    *ret += *results[i];
+    free(results[i]);
+  }
+  free(results);
+  return ret;
+}
+
+static char *test_when_all() {
+  thread_pool_init(&pool, 2);
+
+  int n[NWHEN];
+  future_t *futures = malloc(NWHEN * sizeof(future_t));
+  callable_t callables[NWHEN];
+  future_t all, total;
+  int expected = 0;
+
+  for (int i = 0; i < NWHEN; ++i) {
+    n[i] = i;
+    expected += i * i;
+    callables[i] =
+        (callable_t){.function = squared, .arg = &n[i], .argsz = sizeof(int)};
+  }
+
+  /* Some futures may be done before when_all() registers on them */
+  async_bulk(&pool, futures, callables, NWHEN);
+  mu_assert("when_all failed", when_all(&pool, &all, futures, NWHEN) == 0);
+  map(&pool, &total, &all, sum);
+
+  int *m = await(&total);
+  mu_assert("expected sum of squares", *m == expected);
+  free(m);
+
+  mu_assert("when_all of none failed", when_all(&pool, &all, futures, 0) == 0);
+  mu_assert("expected NULL", await(&all) == NULL);
+
+  thread_pool_destroy(&pool);
+  free(futures);
+  return 0;
+}
+
+static atomic_int gate;
+
+static void *gated(void *arg, size_t argsz, size_t *retsz) {
+  while (!atomic_load(&gate))
+    ;
+  return squared(arg, argsz, retsz);
+}
+
+static char *test_when_any() {
+  thread_pool_init(&pool, 2);
+
+  int n = 7;
+  future_t any;
+  future_t futures[2];
+
+  /* The first future is not done before when_any() is */
+  atomic_store(&gate, 0);
+  async(&pool, &futures[0], (callable_t){.function = gated, .arg = &n, .argsz = sizeof(int)});
+  async(&pool, &futures[1], (callable_t){.function = squared, .arg = &n, .argsz = sizeof(int)});
+
+  mu_assert("when_any failed", when_any(&pool, &any, futures, 2) == 0);
+  mu_assert("expected the second future", await(&any) == &futures[1]);
+  atomic_store(&gate, 1);
+
+  int *m = await(&futures[0]);
+  mu_assert("expected 49", *m == 49);
+  free(m);
+  free(await(&futures[1]));
+
+  mu_assert("when_any of none succeeded", when_any(&pool, &any, futures, 0) == -1);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_when_any_cancelled() {
+  thread_pool_init(&pool, 2);
+
+  int n = 7;
+  cancel_token_t token;
+  future_t any;
+  future_t futures[2];
+
+  cancel_token_init(&token);
+  cancel_token_cancel(&token);
+  atomic_store(&gate, 0);
+
+  /* The cancelled future is done first, yet it cannot win */
+  async(&pool, &futures[0], (callable_t){.function = squared, .arg = &n,
+                                         .argsz = sizeof(int), .token = &token});
+  async(&pool, &futures[1], (callable_t){.function = gated, .arg = &n, .argsz = sizeof(int)});
+
+  while (!future_is_ready(&futures[0]))
+    ;
+
+  mu_assert("when_any failed", when_any(&pool, &any, futures, 2) == 0);
+  mu_assert("expected no winner yet", !future_is_ready(&any));
+  atomic_store(&gate, 1);
+
+  mu_assert("expected the future not cancelled", await(&any) == &futures[1]);
+  mu_assert("expected a winner not cancelled", !future_is_cancelled(&any));
+  free(await(&futures[1]));
+  await(&futures[0]);
+
+  /* With every future cancelled there is no winner */
+  for (int i = 0; i < 2; ++i)
+    async(&pool, &futures[i], (callable_t){.function = squared, .arg = &n,
+                                           .argsz = sizeof(int), .token = &token});
+
+  mu_assert("when_any failed", when_any(&pool, &any, futures, 2) == 0);
+  mu_assert("expected no result", await(&any) == NULL);
+  mu_assert("expected when_any to be cancelled", future_is_cancelled(&any));
+  await(&futures[0]);
+  await(&futures[1]);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static atomic_int called;
+
+static void *counted_square(void *arg, size_t argsz, size_t *retsz) {
+  atomic_fetch_add(&called, 1);
+  return squared(arg, argsz, retsz);
+}
+
+/* Runs until its token is cancelled, as a long computation polling it would */
+static void *until_cancelled(void *arg, size_t argsz __attribute__((unused)),
+                             size_t *retsz __attribute__((unused))) {
+  atomic_store(&gate, 0);
+  while (!cancel_token_is_cancelled(arg))
+    ;
+  return arg;
+}
+
+#define NRACES 1000
+
+static char *test_cancel() {
+  thread_pool_init(&pool, 1);
+
+  int n = 3;
+  cancel_token_t token;
+  future_t running, skipped, mapped;
+
+  cancel_token_init(&token);
+  atomic_store(&called, 0);
+  atomic_store(&gate, 1);
+
+  /* The only thread polls the token, the task behind it waits in the queue */
+  async(&pool, &running, (callable_t){.function = until_cancelled, .arg = &token,
+                                      .token = &token});
+  async(&pool, &skipped, (callable_t){.function = counted_square, .arg = &n,
+                                      .argsz = sizeof(int), .token = &token});
+  map(&pool, &mapped, &skipped, increment);
+
+  while (atomic_load(&gate))
+    ;
+  cancel_token_cancel(&token);
+
+  mu_assert("expected the running task to return", await(&running) == &token);
+  mu_assert("expected no result of a cancelled map", await(&mapped) == NULL);
+  mu_assert("expected the map to be cancelled", future_is_cancelled(&mapped));
+  mu_assert("expected the queued task to be skipped", atomic_load(&called) == 0);
+  mu_assert("expected a done task not to be cancelled", !future_is_cancelled(&running));
+
+  /* A map registered while its future is being cancelled is cancelled as well */
+  atomic_store(&called, 0);
+
+  for (int i = 0; i < NRACES; ++i) {
+    future_t from, to;
+
+    async(&pool, &from, (callable_t){.function = counted_square, .arg = &n,
+                                     .argsz = sizeof(int), .token = &token});
+    map(&pool, &to, &from, counted_square);
+    await(&to);
+    mu_assert("expected the racing map to be cancelled", future_is_cancelled(&to));
+    await(&from);
+  }
+
+  mu_assert("expected no callable of a cancelled future", atomic_load(&called) == 0);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+#define NCONSUMERS 8
+
+static atomic_int destroyed;
+
+static void destroy_int(void *result) {
+  atomic_fetch_add(&destroyed, 1);
+  free(result);
+}
+
+static void *plus_one(void *arg, size_t argsz __attribute__((unused)),
+                      size_t *retsz __attribute__((unused))) {
+  int *ret = malloc(sizeof(int));
+  *ret = *(int *)arg + 1;
+  return ret;
+}
+
+static void *await_shared(void *arg, size_t argsz __attribute__((unused)),
+                          size_t *retsz __attribute__((unused))) {
+  shared_future_t *shared = arg;
+  int *m = shared_await(shared);
+  int *ret = malloc(sizeof(int));
+  *ret = *m;
+  shared_future_release(shared);
+  return ret;
+}
+
+static char *test_shared_future() {
+  thread_pool_init(&pool, 2);
+
+  int n = 6;
+  future_t maps[NCONSUMERS], awaits[NCONSUMERS];
+
+  atomic_store(&destroyed, 0);
+  atomic_store(&called, 0);
+  shared_future_t *shared = shared_async(
+      &pool, (callable_t){.function = counted_square, .arg = &n, .argsz = sizeof(int)},
+      destroy_int);
+  mu_assert("shared_async failed", shared != NULL);
+
+  /* Maps and awaits from pool tasks, each with a reference of its own */
+  for (int i = 0; i < NCONSUMERS; ++i) {
+    mu_assert("shared_map failed", shared_map(&pool, &maps[i], shared, plus_one) == 0);
+    async(&pool, &awaits[i], (callable_t){.function = await_shared,
+                                          .arg = shared_future_ref(shared)});
+  }
+
+  mu_assert("expected 36", *(int *)shared_await(shared) == 36);
+  shared_future_release(shared);
+
+  for (int i = 0; i < NCONSUMERS; ++i) {
+    int *m = await(&maps[i]);
+    mu_assert("expected 37 from each map", *m == 37);
+    free(m);
+    m = await(&awaits[i]);
+    mu_assert("expected 36 from each await", *m == 36);
+    free(m);
+  }
+
+  thread_pool_wait_idle(&pool);
+  mu_assert("expected a single run of the callable", atomic_load(&called) == 1);
+  mu_assert("expected the result freed once", atomic_load(&destroyed) == 1);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_map_chain);
+  mu_run_test(test_when_all);
+  mu_run_test(test_when_any);
+  mu_run_test(test_when_any_cancelled);
+  mu_run_test(test_cancel);
+  mu_run_test(test_shared_future);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ " %s\n", result);
+  } else {
+    printf(__FILE__ " ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
@@ -0,0 +1,189 @@
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "minunit.h"
+#include "threadpool.h"
+
+int tests_run = 0;
+
+static char *histogram_percentiles() {
+  histogram h;
+  histogram_init(&h);
+
+  for (uint64_t i = 1; i <= 1000; ++i)
+    histogram_record(&h, i);
+
+  uint64_t p50 = histogram_percentile(&h, 50);
+  uint64_t p99 = histogram_percentile(&h, 99);
+
+  mu_assert("expected 1000 values", histogram_count(&h) == 1000);
+  mu_assert("expected p50 within a bucket of 500", p50 >= 500 && p50 < 500 + 500 / 8 + 1);
+  mu_assert("expected p99 within a bucket of 990", p99 >= 990 && p99 < 990 + 990 / 8 + 1);
+  mu_assert("expected small values exactly", histogram_percentile(&h, 0) == 1);
+  return 0;
+}
+
+#define NJOBS 1000
+
+static atomic_int counter;
+
+static void count(void *args, size_t argsz __attribute__((unused))) {
+  if (atomic_fetch_add(&counter, 1) + 1 == NJOBS)
+    sem_post(args);
+}
+
+static char *pool_stats() {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 2);
+  options.metrics_sample = 1;
+  thread_pool_init_ex(&pool, &options);
+
+  sem_t done;
+  sem_init(&done, 0, 0);
+
+  for (int i = 0; i < NJOBS; ++i)
+    defer(&pool, (runnable_t){.function = count, .arg = &done, .argsz = 0});
+
+  sem_wait(&done);
+
+  /* The last job is counted once it returns, a moment after it posted */
+  thread_pool_stats_t stats;
+  do {
+    sched_yield();
+    thread_pool_stats(&pool, &stats);
+  } while (stats.tasks_executed != NJOBS);
+
+  mu_assert("expected every job timed in queue",
+            histogram_count(&stats.queue_wait) == NJOBS);
+  mu_assert("expected every job timed running",
+            histogram_count(&stats.exec) == NJOBS);
+  mu_assert("expected p50 <= p99",
+            histogram_percentile(&stats.queue_wait, 50) <=
+                histogram_percentile(&stats.queue_wait, 99));
+  mu_assert("expected a job node per job",
+            stats.slab_hits + stats.slab_misses == NJOBS);
+  mu_assert("expected 2 threads", stats.num_threads == 2);
+  mu_assert("expected an empty queue", stats.queue_depth == 0);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&done);
+  return 0;
+}
+
+static atomic_int finished;
+
+static void sleep_count(void *args __attribute__((unused)),
+                        size_t argsz __attribute__((unused))) {
+  usleep(100);
+  atomic_fetch_add(&finished, 1);
+}
+
+static void wait_sem(void *args, size_t argsz __attribute__((unused))) {
+  sem_t *started = args;
+  sem_t *blocker = (sem_t *)args + 1;
+
+  sem_post(started);
+  sem_wait(blocker);
+}
+
+static char *wait_idle() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 2);
+
+  for (int i = 0; i < 100; ++i)
+    defer(&pool, (runnable_t){.function = sleep_count, .arg = NULL, .argsz = 0});
+
+  mu_assert("wait_idle failed", thread_pool_wait_idle(&pool) == 0);
+  mu_assert("expected every task done", atomic_load(&finished) == 100);
+
+  sem_t sems[2];
+  sem_init(&sems[0], 0, 0);
+  sem_init(&sems[1], 0, 0);
+  defer(&pool, (runnable_t){.function = wait_sem, .arg = sems, .argsz = sizeof(sem_t) * 2});
+  sem_wait(&sems[0]);
+
+  mu_assert("expected a timeout on a busy pool",
+            thread_pool_wait_idle_timeout(&pool, 1000000) == -1 && errno == ETIMEDOUT);
+
+  sem_post(&sems[1]);
+  mu_assert("expected the pool to become idle",
+            thread_pool_wait_idle_timeout(&pool, 1000000000) == 0);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&sems[0]);
+  sem_destroy(&sems[1]);
+  return 0;
+}
+
+static void sleep_task(void *args __attribute__((unused)),
+                       size_t argsz __attribute__((unused))) {
+  usleep(5000);
+}
+
+static char *elastic() {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 1);
+  options.max_threads = 4;
+  options.grow_wait_ns = 1000000;
+  options.keep_alive_ns = 20000000;
+  options.metrics_sample = 1;
+  thread_pool_init_ex(&pool, &options);
+
+  for (int i = 0; i < 32; ++i)
+    defer(&pool, (runnable_t){.function = sleep_task, .arg = NULL, .argsz = 0});
+
+  thread_pool_wait_idle(&pool);
+
+  thread_pool_stats_t stats;
+  thread_pool_stats(&pool, &stats);
+  mu_assert("expected the pool to grow", stats.num_threads > 1);
+  mu_assert("expected the pool to stay within bounds", stats.num_threads <= 4);
+  mu_assert("expected every task done", stats.tasks_executed == 32);
+
+  /* Spare threads retire after keep_alive_ns */
+  for (int i = 0; i < 100 && stats.num_threads > 1; ++i) {
+    usleep(5000);
+    thread_pool_stats(&pool, &stats);
+  }
+
+  mu_assert("expected the spare threads to retire", stats.num_threads == 1);
+
+  /* Retired slots are reused */
+  for (int i = 0; i < 32; ++i)
+    defer(&pool, (runnable_t){.function = sleep_task, .arg = NULL, .argsz = 0});
+
+  thread_pool_wait_idle(&pool);
+  thread_pool_stats(&pool, &stats);
+  mu_assert("expected the pool to grow again", stats.num_threads > 1);
+  mu_assert("expected every task done", stats.tasks_executed == 64);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(histogram_percentiles);
+  mu_run_test(pool_stats);
+  mu_run_test(wait_idle);
+  mu_run_test(elastic);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ "Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
@@ -1,41 +1,106 @@
 #include "threadpool.h"
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
 #include "vector.h"
 
 /* ========================== FUNCTION PROTOTYPES ============================ */
-static void bsem_init(bsem *bsem_p, size_t v);
+static int thread_init(thread_pool_t *pool, thread **thread_p, size_t id);
 
-static void bsem_reset(bsem *bsem_p);
+static int thread_start(thread *thread_p);
 
-static void bsem_wait(bsem *bsem_p);
+static int thread_pool_place(thread_pool_t *pool);
 
-static void bsem_notify(bsem *bsem_p);
+static void thread_destroy(thread *thread_p);
 
-static void bsem_notifyAll(bsem *bsem_p);
+static void job_init(thread_pool_t *pool, job *job_p, runnable_t runnable, uint64_t submitted);
 
-static int thread_init(thread_pool_t *pool, thread **thread_p);
+static void job_run(job *job_p);
 
-static void thread_destroy(thread *thread_p);
+static uint64_t submit_time(thread_pool_t *pool);
+
+static uint64_t monotonic_ns(void);
+
+static void thread_run_job(thread *thread_p, job *job_p, job *ring_job);
+
+static thread_pool_full submit_policy(thread_pool_t *pool, int local);
+
+static size_t defer_batch(thread_pool_t *pool, runnable_t *runnables, size_t n, int local,
+                          thread_pool_full on_full, batch_room mode);
+
+static size_t defer_ring_batch(thread_pool_t *pool, jobqueue *jobqueue_p, runnable_t *runnables, size_t n,
+                               thread_pool_full on_full, batch_room mode);
+
+static int defer_publish(thread_pool_t *pool, jobqueue *jobqueue_p, job **jobs, size_t n, int local);
+
+static job *thread_find_level(thread *thread_p, thread_pool_prio prio, job *ring_job);
+
+static job *thread_find_job(thread *thread_p, job *ring_job);
+
+static job *thread_wait_job(thread *thread_p, int *retired);
+
+static int thread_retire(thread *thread_p);
+
+static void thread_pool_grow(thread_pool_t *pool, uint64_t now);
 
 static void *thread_do(thread *thread_p);
 
-static int jobqueue_init(jobqueue *jobqueue_p);
+static void thread_pool_signal_idle(thread_pool_t *pool);
+
+static int timer_schedule(thread_pool_t *pool, runnable_t runnable, uint64_t delay_ns, uint64_t period_ns);
+
+static void timer_defer_expired(thread_pool_t *pool, timer *expired);
+
+static void *timer_do(thread_pool_t *pool);
 
-static void jobqueue_clear(jobqueue *jobqueue_p);
+static void timer_stop(thread_pool_t *pool);
 
-static void jobqueue_push(jobqueue *jobqueue_p, job *job_p);
+static bool parallel_hungry(thread_pool_t *pool);
 
-static job *jobqueue_pull(jobqueue *jobqueue_p);
+static void parallel_run(parallel_loop *loop, size_t begin, size_t end);
 
-static void jobqueue_destroy(jobqueue *jobqueue_p);
+static void parallel_piece_run(void *arg, size_t argsz);
+
+static int parallel_loop_run(parallel_loop *loop, size_t begin, size_t end);
+
+static int jobqueue_init(jobqueue *jobqueue_p, const thread_pool_options_t *options);
+
+static void jobqueue_clear(thread_pool_t *pool, jobqueue *jobqueue_p);
+
+static void jobqueue_push(jobqueue *jobqueue_p, job *front, job *rear, size_t n);
+
+static int jobqueue_push_ring(thread_pool_t *pool, jobqueue *jobqueue_p, const job *jobs, size_t n,
+                              thread_pool_full on_full);
+
+static int ring_push_jobs(ring *ring_p, const job *jobs, size_t n);
+
+static int pool_room_reserve(thread_pool_t *pool, size_t n);
+
+static int pool_room_take(thread_pool_t *pool, jobqueue *jobqueue_p, size_t n, thread_pool_full on_full);
+
+static void pool_room_release(thread_pool_t *pool, size_t n);
+
+static job *jobqueue_pull(jobqueue *jobqueue_p, job *ring_job);
+
+static size_t jobqueue_len(jobqueue *jobqueue_p);
+
+static size_t jobqueues_len(thread_pool_t *pool);
+
+static void jobqueue_destroy(thread_pool_t *pool, size_t levels);
 
 /* =========================================================================== */
 
 static vector vec;
 
+/* Thread of a thread pool the calling thread is, NULL for other threads */
+static __thread thread *current_thread = NULL;
+
 /* When library is loaded, function is run, typically during program startup */
 static __attribute__ ((constructor)) void vec_initializer() {
     vector_init(&vec);
@@ -73,6 +138,29 @@ static void set_sig_handler(void) {
     }
 }
 
+/**
+ * Fills options with the defaults used by thread_pool_init().
+ * @param options     - pointer on the options
+ * @param num_threads - number of the threads in the thread_pool
+ */
+void thread_pool_options_init(thread_pool_options_t *options, size_t num_threads) {
+    options->num_threads = num_threads;
+    options->max_threads = num_threads;
+    options->grow_wait_ns = THREAD_POOL_GROW_WAIT_NS;
+    options->keep_alive_ns = THREAD_POOL_KEEP_ALIVE_NS;
+    options->pin = THREAD_POOL_PIN_NONE;
+    options->numa_node = -1;
+    options->stack_size = 0;
+    options->queue = THREAD_POOL_QUEUE_LIST;
+    options->queue_capacity = THREAD_POOL_RING_CAPACITY;
+    options->max_queued = 0;
+    options->on_full = THREAD_POOL_FULL_BLOCK;
+    options->full_timeout_ns = THREAD_POOL_FULL_TIMEOUT_NS;
+    options->prealloc = 0;
+    options->inline_args = false;
+    options->metrics_sample = THREAD_POOL_METRICS_SAMPLE;
+}
+
 /**
  * Initializes thread_pool with exact amount of threads.
  * Adds thread_pool pointer in the vector 'vec' to be deleted if
@@ -82,60 +170,154 @@ static void set_sig_handler(void) {
  * @return 0 on success, otherwise -1 if some failures happened.
  */
 int thread_pool_init(thread_pool_t *pool, size_t num_threads) {
+    thread_pool_options_t options;
+    thread_pool_options_init(&options, num_threads);
+
+    return thread_pool_init_ex(pool, &options);
+}
+
+/**
+ * Initializes thread_pool as described by the options.
+ * @param pool    - pointer on thread_pool
+ * @param options - pointer on options, see thread_pool_options_init()
+ * @return 0 on success, otherwise -1 if some failures happened.
+ */
+int thread_pool_init_ex(thread_pool_t *pool, const thread_pool_options_t *options) {
     if (pool == NULL) {
         err("thread_pool_init(): thread_pool is a null pointer.\n");
         return -1;
     }
 
-    pool->keepAlive = 1;
-    pool->num_threads_alive = 0;
-    pool->num_threads_working = 0;
+    if (options == NULL) {
+        err("thread_pool_init(): options is a null pointer.\n");
+        return -1;
+    }
 
-    /* ThreadPool should have a job queue */
-    pool->jobqueue = malloc(sizeof(struct jobqueue));
+    size_t num_threads = options->num_threads;
+    size_t max_threads = options->max_threads > num_threads ? options->max_threads : num_threads;
 
-    if (pool->jobqueue == NULL) {
-        err("jobqueue_init(): Malloc failed for job queue.\n");
+    /* Threads are started when timed jobs wait for too long */
+    if (max_threads > num_threads && options->metrics_sample == 0) {
+        err("thread_pool_init(): Elastic thread pool needs metrics_sample.\n");
         return -1;
     }
 
-    if (jobqueue_init(pool->jobqueue) == -1) {
-        err("thread_pool_init(): Initialising job queue failed.\n");
+    pool->options = *options;
+    pool->options.max_threads = max_threads;
+
+    atomic_init(&pool->keepAlive, 1);
+    pool->num_threads = max_threads;
+    atomic_init(&pool->num_threads_alive, num_threads);
+    atomic_init(&pool->num_threads_working, 0);
+    atomic_init(&pool->idle_waiters, 0);
+    atomic_init(&pool->timers_pending, 0);
+    atomic_init(&pool->last_grow, 0);
+
+    /* The lists and the deques of every level share a single bound */
+    pool->bounded = options->max_queued > 0;
+    atomic_init(&pool->room, options->max_queued);
+    eventcount_init(&pool->not_full);
+
+    size_t slabs = 0, levels = 0, slots = 0, started = 0;
+    pthread_condattr_t attr;
+
+    if (park_lot_init(&pool->idle) == -1) {
+        err("thread_pool_init(): park lot initialisation failed.\n");
         return -1;
     }
 
+    pool->spin_max = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? THREAD_POOL_SPIN_ROUNDS : 0;
+
+    for (; slabs < THREAD_POOL_SLAB_CLASSES; ++slabs) {
+        if (slab_init(&pool->slabs[slabs], THREAD_POOL_SLAB_MIN_BLOCK << slabs, max_threads, options->prealloc) == -1) {
+            err("thread_pool_init(): slab initialisation failed.\n");
+            goto fail_slabs;
+        }
+    }
+
+    /* ThreadPool should have a job queue for each priority level */
+    pool->jobqueue = malloc(THREAD_POOL_PRIORITIES * sizeof(struct jobqueue));
+
+    if (pool->jobqueue == NULL) {
+        err("jobqueue_init(): Malloc failed for job queue.\n");
+        goto fail_slabs;
+    }
+
+    for (; levels < THREAD_POOL_PRIORITIES; ++levels) {
+        if (jobqueue_init(&pool->jobqueue[levels], options) == -1) {
+            err("thread_pool_init(): Initialising job queue failed.\n");
+            goto fail_jobqueues;
+        }
+    }
+
     /* Creating the threads in the thread pool */
-    pool->threads = malloc(num_threads * sizeof(struct thread *));
+    pool->threads = malloc(max_threads * sizeof(struct thread *));
     if (pool->threads == NULL) {
         err("thread_pool_init(): Malloc failed for creating threads\n");
-        jobqueue_destroy(pool->jobqueue);
-        free(pool);
-        return -1;
+        goto fail_jobqueues;
     }
 
     /* Initialise mutex and condition in thread pool */
     if (pthread_mutex_init(&pool->thcount_lock, 0)) {
         err("thread_pool_init(): mutex initialisation failed.\n");
-        jobqueue_destroy(pool->jobqueue);
-        free(pool->threads);
-        free(pool);
-        return -1;
+        goto fail_threads;
     }
 
-    if (pthread_cond_init(&pool->threads_idle, 0) != 0) {
+    /* thread_pool_wait_idle_timeout() measures its timeout on the monotonic clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    if (pthread_cond_init(&pool->threads_idle, &attr) != 0) {
         err("thread_pool_init(): condition initialisation failed.\n");
-        return -1;
+        pthread_condattr_destroy(&attr);
+        goto fail_thcount_lock;
+    }
+
+    /* The timer thread sleeps until a tick of the monotonic clock as well */
+    if (pthread_mutex_init(&pool->timer_lock, 0) != 0) {
+        err("thread_pool_init(): timer initialisation failed.\n");
+        pthread_condattr_destroy(&attr);
+        goto fail_threads_idle;
+    }
+
+    if (pthread_cond_init(&pool->timer_cond, &attr) != 0) {
+        err("thread_pool_init(): timer initialisation failed.\n");
+        pthread_condattr_destroy(&attr);
+        goto fail_timer_lock;
     }
 
+    pthread_condattr_destroy(&attr);
+
+    timer_wheel_init(&pool->wheel, monotonic_ns() / THREAD_POOL_TIMER_TICK_NS);
+    pool->timer_wake = UINT64_MAX;
+    pool->timer_started = false;
+    pool->timer_stop = false;
+
     set_sig_handler();
 
-    for (size_t i = 0; i < num_threads; ++i) {
-        thread_init(pool, &pool->threads[i]);
+    /* Every slot must exist before any thread starts stealing from the others */
+    for (; slots < max_threads; ++slots) {
+        if (thread_init(pool, &pool->threads[slots], slots) == -1) {
+            err("thread_pool_init(): Initialising threads failed.\n");
+            goto fail_slots;
+        }
+    }
+
+    if (thread_pool_place(pool) == -1) {
+        err("thread_pool_init(): Placing threads failed.\n");
+        goto fail_slots;
     }
 
-    /* Waiting to all threads to be initialised */
-    while (pool->num_threads_alive != num_threads) {
-        usleep(100 * 1000);
+    /* Jobs deferred before a thread runs wait in the queue, there is no need to wait for the threads */
+    for (; started < num_threads; ++started) {
+        pool->threads[started]->alive = true;
+
+        if (thread_start(pool->threads[started]) == -1) {
+            err("thread_pool_init(): Starting threads failed.\n");
+            goto fail_started;
+        }
+
+        pool->threads[started]->joinable = true;
     }
 
     int id = vector_add(&vec, pool);
@@ -144,6 +326,43 @@ int thread_pool_init(thread_pool_t *pool, size_t num_threads) {
     pool->id = id;
 
     return 0;
+
+    /* Whatever was set up is released in the reverse order */
+fail_started:
+    pthread_mutex_lock(&pool->thcount_lock);
+    atomic_store(&pool->keepAlive, 0);
+    pthread_mutex_unlock(&pool->thcount_lock);
+
+    park_lot_unpark_all(&pool->idle);
+
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(pool->threads[i]->pthread, NULL);
+    }
+
+fail_slots:
+    for (size_t i = 0; i < slots; ++i) {
+        thread_destroy(pool->threads[i]);
+    }
+
+    pthread_cond_destroy(&pool->timer_cond);
+fail_timer_lock:
+    pthread_mutex_destroy(&pool->timer_lock);
+fail_threads_idle:
+    pthread_cond_destroy(&pool->threads_idle);
+fail_thcount_lock:
+    pthread_mutex_destroy(&pool->thcount_lock);
+fail_threads:
+    free(pool->threads);
+fail_jobqueues:
+    jobqueue_destroy(pool, levels);
+    free(pool->jobqueue);
+fail_slabs:
+    while (slabs > 0)
+        slab_destroy(&pool->slabs[--slabs]);
+
+    park_lot_destroy(&pool->idle);
+
+    return -1;
 }
 
 /**
@@ -156,28 +375,44 @@ void thread_pool_destroy(thread_pool_t *pool) {
     if (pool == NULL)
         return;
 
-    volatile size_t totalThreads = pool->num_threads_alive;
+    size_t totalThreads = pool->num_threads;
+
+    /* Timers still pending are dropped, the jobs of the expired ones were deferred already */
+    timer_stop(pool);
+
+    /* Each threads infinite loop should be ended, and no thread is started once it is */
+    pthread_mutex_lock(&pool->thcount_lock);
+    atomic_store(&pool->keepAlive, 0);
+    pthread_mutex_unlock(&pool->thcount_lock);
 
-    /* Each threads infinite loop should be ended */
-    pool->keepAlive = 0;
+    /* A thread parks only after it checked keepAlive, so every thread either
+     * sees it cleared or is in the lot by now. Threads finish the submitted
+     * tasks before they end. */
+    park_lot_unpark_all(&pool->idle);
 
-    /* Kill threads */
-    while (pool->num_threads_alive) {
-        bsem_notifyAll(pool->jobqueue->has_jobs);
-        /* Notify all threads to finish submitted tasks and end */
-        usleep(100 * 1000);
+    /* Slots whose thread ended for being idle are joined as well */
+    for (size_t i = 0; i < totalThreads; ++i) {
+        if (pool->threads[i]->joinable)
+            pthread_join(pool->threads[i]->pthread, NULL);
     }
 
     /* Destroying job queue of the thread pool */
-    jobqueue_destroy(pool->jobqueue);
+    jobqueue_destroy(pool, THREAD_POOL_PRIORITIES);
 
     /* Free allocated memories */
     for (size_t i = 0; i < totalThreads; ++i) {
         thread_destroy(pool->threads[i]);
     }
 
+    park_lot_destroy(&pool->idle);
     pthread_mutex_destroy(&pool->thcount_lock);
     pthread_cond_destroy(&pool->threads_idle);
+    pthread_mutex_destroy(&pool->timer_lock);
+    pthread_cond_destroy(&pool->timer_cond);
+
+    for (size_t i = 0; i < THREAD_POOL_SLAB_CLASSES; ++i) {
+        slab_destroy(&pool->slabs[i]);
+    }
 
     free(pool->threads);
     free(pool->jobqueue);
@@ -186,267 +421,1871 @@ void thread_pool_destroy(thread_pool_t *pool) {
 }
 
 /**
- * Submits new task/runnable to thread_pool's jobqueue.
+ * Submits new task/runnable to the timer wheel of thread_pool, from where it
+ * is deferred with normal priority once delay_ns nanoseconds passed, rounded up
+ * to THREAD_POOL_TIMER_TICK_NS. The argument is copied as by defer().
+ * No thread is occupied meanwhile. thread_pool_wait_idle() waits for the task,
+ * thread_pool_destroy() drops it if it is still pending.
+ * @param pool     - pointer on the thread_pool
+ * @param runnable - runnable task to be completed by thread_pool threads
+ * @param delay_ns - delay in nanoseconds, measured on CLOCK_MONOTONIC
+ * @return 0 on success, others -1 if some failures happened.
+ */
+int defer_after(thread_pool_t *pool, runnable_t runnable, uint64_t delay_ns) {
+    return timer_schedule(pool, runnable, delay_ns, 0);
+}
+
+/**
+ * As defer_after(), but the task is deferred every period_ns nanoseconds,
+ * first after one period, until thread_pool_destroy(). Runs missed while
+ * the pool was behind are skipped. thread_pool_wait_idle() does not wait
+ * for periodic tasks. The argument must stay valid until the pool is
+ * destroyed, unless it is copied in inline_args mode.
+ * @param pool      - pointer on the thread_pool
+ * @param runnable  - runnable task to be completed by thread_pool threads
+ * @param period_ns - period in nanoseconds, more than 0
+ * @return 0 on success, others -1 if some failures happened.
+ */
+int defer_periodic(thread_pool_t *pool, runnable_t runnable, uint64_t period_ns) {
+    if (period_ns == 0) {
+        err("defer_periodic(): Period must be positive.\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    return timer_schedule(pool, runnable, period_ns, period_ns);
+}
+
+/**
+ * Submits new task/runnable to thread_pool's jobqueue, with normal priority.
+ * If called from one of the pool's threads, the task goes to the deque
+ * of that thread instead, from where idle threads may steal it.
+ * With the inline_args option, an argument of at most THREAD_POOL_INLINE_ARG_SIZE
+ * bytes is copied into the job: the function gets a pointer to the copy, valid
+ * for the duration of the call, and the caller may reuse its memory at once.
+ * An argsz of 0 passes the pointer as it is.
+ * If the ring is full, or the pool holds max_queued jobs in its lists and
+ * deques, defer() behaves as set by the on_full option. A thread of the pool
+ * runs the task itself then, unless the option is THREAD_POOL_FULL_ERROR.
  * Non-blocking function, so submitted task may not be immediately completed.
  * @param pool - pointer on the thread_pool
  * @param runnable - runnable task to be completed by thread_pool threads
  * @return 0 on success, others -1 if some failures happened.
  */
 int defer(thread_pool_t *pool, runnable_t runnable) {
+    return defer_prio(pool, runnable, THREAD_POOL_PRIO_NORMAL);
+}
+
+/**
+ * Submits new task/runnable to the jobqueue of the given priority level.
+ * Threads take jobs of a higher level first, except for every
+ * THREAD_POOL_AGING_ROUNDS-th job, which they take from the lowest level
+ * that has one, so no level starves. Only normal priority jobs deferred
+ * by the pool's own threads go to their deques, the others always go
+ * to the queue of their level. Otherwise as defer().
+ * @param pool     - pointer on the thread_pool
+ * @param runnable - runnable task to be completed by thread_pool threads
+ * @param prio     - priority level of the task
+ * @return 0 on success, others -1 if some failures happened.
+ */
+int defer_prio(thread_pool_t *pool, runnable_t runnable, thread_pool_prio prio) {
     if (pool == NULL) {
         err("defer(): defer is called on null pointer.\n");
         return -1;
     }
 
-    if (pool->keepAlive == 0) {
+    if ((unsigned int) prio >= THREAD_POOL_PRIORITIES) {
+        err("defer(): Unknown priority level.\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    jobqueue *jobqueue_p = &pool->jobqueue[prio];
+    int local = current_thread != NULL && current_thread->thread_pool_p == pool;
+
+    /* Tasks still running while the pool is destroyed may defer more, their thread runs them */
+    if (!local && atomic_load(&pool->keepAlive) == 0) {
         err("defer(): After thread_pool_destroy defer is called.\n");
         return -1;
     }
 
+    int to_deque = local && prio == THREAD_POOL_PRIO_NORMAL;
+    thread_pool_full on_full = submit_policy(pool, local);
+
+    /* Ring stores the job by value, there is nothing to allocate */
+    if (!to_deque && jobqueue_p->ring != NULL) {
+        job ring_job;
+        job_init(pool, &ring_job, runnable, submit_time(pool));
+
+        int room = jobqueue_push_ring(pool, jobqueue_p, &ring_job, 1, on_full);
+
+        if (room == -1)
+            return -1;
+
+        if (room == 1) {
+            runnable.function(runnable.arg, runnable.argsz);
+            return 0;
+        }
+
+        park_lot_unpark(&pool->idle, 1);
+
+        return 0;
+    }
+
+    if (pool->bounded) {
+        int room = pool_room_take(pool, jobqueue_p, 1, on_full);
+
+        if (room == -1)
+            return -1;
+
+        if (room == 1) {
+            runnable.function(runnable.arg, runnable.argsz);
+            return 0;
+        }
+    }
+
     job *job_p;
 
-    job_p = malloc(sizeof(struct job));
+    job_p = thread_pool_alloc(pool, sizeof(struct job));
 
     if (job_p == NULL) {
         err("defer(): Malloc failed for new submitted task.\n");
+        pool_room_release(pool, 1);
         return -1;
     }
 
-    job_p->job = runnable;
+    job_init(pool, job_p, runnable, submit_time(pool));
+
+    if (to_deque) {
+        if (deque_push(&current_thread->deque, job_p) == -1) {
+            thread_pool_free(pool, job_p, sizeof(struct job));
+            pool_room_release(pool, 1);
+            return -1;
+        }
 
-    jobqueue_push(pool->jobqueue, job_p);
+        /* Wake up a thread which may steal the job */
+        park_lot_unpark(&pool->idle, 1);
+    } else {
+        jobqueue_push(jobqueue_p, job_p, job_p, 1);
+        park_lot_unpark(&pool->idle, 1);
+    }
 
     return 0;
 }
 
-/* ================================================================== */
-
-/* ============================ THREAD ============================== */
+/**
+ * Submits n runnables at once, as if defer() was called for each of them
+ * in order, but the whole batch is linked into the job queue under a single
+ * lock (or reserved in the ring with a single CAS, or published in the deque
+ * of the calling thread at once) and at most n idle threads are woken up.
+ * The batch is all or nothing: on failure none of the runnables was queued
+ * or run. With THREAD_POOL_FULL_ERROR or THREAD_POOL_FULL_TIMEOUT, a batch
+ * which does not fit into the ring, or into the room max_queued leaves, is
+ * rejected as a whole, larger than either even with errno set to EAGAIN at once.
+ * Otherwise the batch goes in parts as room frees, and does not fail on a full queue.
+ * @param pool      - pointer on the thread_pool
+ * @param runnables - array of n runnables
+ * @param n         - number of the runnables
+ * @return 0 on success, others -1 if some failures happened.
+ */
+int defer_bulk(thread_pool_t *pool, runnable_t *runnables, size_t n) {
+    if (pool == NULL) {
+        err("defer_bulk(): defer_bulk is called on null pointer.\n");
+        return -1;
+    }
 
-static int thread_init(thread_pool_t *pool, thread **thread_p) {
-    *thread_p = malloc(sizeof(struct thread));
+    int local = current_thread != NULL && current_thread->thread_pool_p == pool;
 
-    if (*thread_p == NULL) {
-        err("thread_init(): Malloc failed for thread initialisation.\n");
+    if (!local && atomic_load(&pool->keepAlive) == 0) {
+        err("defer_bulk(): After thread_pool_destroy defer_bulk is called.\n");
         return -1;
     }
 
-    (*thread_p)->thread_pool_p = pool;
+    thread_pool_full on_full = submit_policy(pool, local);
+    batch_room mode = on_full == THREAD_POOL_FULL_ERROR || on_full == THREAD_POOL_FULL_TIMEOUT ?
+                      BATCH_ROOM_WHOLE : BATCH_ROOM_PARTS;
 
-    pthread_create(&(*thread_p)->pthread, NULL, (void *) thread_do, (*thread_p));
+    return defer_batch(pool, runnables, n, local, on_full, mode) == n ? 0 : -1;
+}
 
-    /* Threads in the thread pool are disconnected and
-     * it should not be possible to wait until they end.
-     * In short, threads are not "joinable".
-     */
-    pthread_detach((*thread_p)->pthread);
+/* Part of the n jobs left to submit which fits into the free places, at least one */
+static size_t batch_chunk(size_t n, size_t free) {
+    if (free == 0)
+        return 1;
 
-    return 0;
+    return n < free ? n : free;
 }
 
-/* Just frees the allocated memory for a thread struct */
-static void thread_destroy(thread *thread_p) {
-    free(thread_p);
+/* Runs jobs held by pointer on the calling thread, as the queue was full, and frees them */
+static void batch_run(thread_pool_t *pool, job **jobs, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        job_run(jobs[i]);
+        thread_pool_free(pool, jobs[i], sizeof(struct job));
+    }
 }
 
 /**
- * Function blocks SIGINT signal for the current thread.
+ * Submits the runnables of defer_bulk() as the policy on_full says.
+ * Every job is allocated before room is made for any, so a failure leaves
+ * nothing queued, unless parts of the batch were already. The batch takes
+ * room as mode says, see batch_room. BATCH_ROOM_TRY never waits, and a
+ * batch it stops short is not counted as rejected, as its caller retries it.
+ * @return number of the runnables queued or run, from the first one on,
+ *         the others were not submitted.
  */
-static void mask_sig(void) {
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-
-    pthread_sigmask(SIG_BLOCK, &mask, NULL);
-}
+static size_t defer_batch(thread_pool_t *pool, runnable_t *runnables, size_t n, int local,
+                          thread_pool_full on_full, batch_room mode) {
+    if (n == 0)
+        return 0;
 
-static void *thread_do(thread *thread_p) {
-    /* SIGINT should be blocked for thread_pool threads. */
-    mask_sig();
-
-    thread_pool_t *pool = thread_p->thread_pool_p;
+    jobqueue *jobqueue_p = &pool->jobqueue[THREAD_POOL_PRIO_NORMAL];
 
-    pthread_mutex_lock(&pool->thcount_lock);
-    pool->num_threads_alive += 1;
-    pthread_mutex_unlock(&pool->thcount_lock);
+    if (!local && jobqueue_p->ring != NULL)
+        return defer_ring_batch(pool, jobqueue_p, runnables, n, on_full, mode);
 
-    /* keepAlive will be set to 0 while destroying the thread pool of the thread */
-    while (pool->keepAlive || pool->jobqueue->len != 0) {
-        bsem_wait(pool->jobqueue->has_jobs);
+    size_t max_queued = pool->options.max_queued;
 
-        if (pool->keepAlive || pool->jobqueue->len != 0) {
-            pthread_mutex_lock(&pool->thcount_lock);
-            pool->num_threads_working += 1;
-            pthread_mutex_unlock(&pool->thcount_lock);
+    if (pool->bounded && mode == BATCH_ROOM_WHOLE && n > max_queued) {
+        atomic_fetch_add_explicit(&jobqueue_p->rejected, 1, memory_order_relaxed);
+        errno = EAGAIN;
+        return 0;
+    }
 
-            /* Get job from job queue and process */
-            void (*func)(void *, size_t);
-            void *arg;
-            size_t argsz;
+    job **jobs = malloc(n * sizeof(struct job *));
 
-            job *job_p = jobqueue_pull(pool->jobqueue);
+    if (jobs == NULL) {
+        err("defer_bulk(): Malloc failed for new submitted tasks.\n");
+        return 0;
+    }
 
-            if (job_p != NULL) {
-                func = job_p->job.function;
-                arg = job_p->job.arg;
-                argsz = job_p->job.argsz;
+    uint64_t submitted = submit_time(pool);
 
-                func(arg, argsz);
-                free(job_p);
-            }
+    for (size_t i = 0; i < n; ++i) {
+        jobs[i] = thread_pool_alloc(pool, sizeof(struct job));
 
-            pthread_mutex_lock(&pool->thcount_lock);
-            pool->num_threads_working -= 1;
+        if (jobs[i] == NULL) {
+            err("defer_bulk(): Malloc failed for new submitted task.\n");
 
-            if (!pool->num_threads_working)
-                pthread_cond_broadcast(&pool->threads_idle);
+            while (i > 0)
+                thread_pool_free(pool, jobs[--i], sizeof(struct job));
 
-            pthread_mutex_unlock(&pool->thcount_lock);
+            free(jobs);
+            return 0;
         }
+
+        job_init(pool, jobs[i], runnables[i], submitted);
     }
 
-    pthread_mutex_lock(&pool->thcount_lock);
-    pool->num_threads_alive -= 1;
-    pthread_mutex_unlock(&pool->thcount_lock);
+    size_t done = 0;
 
-    /* NULL on SUCCESS, thread function should be of type (void *) */
-    return NULL;
-}
+    while (done < n) {
+        size_t chunk = n - done;
 
-/* ================================================================== */
+        if (pool->bounded) {
+            /* Waiting for room for the whole rest would wait for an empty pool */
+            if (mode != BATCH_ROOM_WHOLE)
+                chunk = batch_chunk(chunk, atomic_load_explicit(&pool->room, memory_order_relaxed));
 
-/* ============================ JOB QUEUE =========================== */
+            int room = mode == BATCH_ROOM_TRY ? pool_room_reserve(pool, chunk)
+                                              : pool_room_take(pool, jobqueue_p, chunk, on_full);
 
-static int jobqueue_init(jobqueue *jobqueue_p) {
-    jobqueue_p->len = 0;
-    jobqueue_p->front = NULL;
-    jobqueue_p->rear = NULL;
+            if (room == -1)
+                break;
 
-    jobqueue_p->has_jobs = malloc(sizeof(struct bin_sem));
+            if (room == 1) {
+                batch_run(pool, jobs + done, chunk);
+                done += chunk;
+                continue;
+            }
+        }
 
-    if (jobqueue_p->has_jobs == NULL) {
-        err("jobqueue_init(): Malloc failed for has_jobs.\n");
-        return -1;
-    }
+        if (defer_publish(pool, jobqueue_p, jobs + done, chunk, local) == -1) {
+            pool_room_release(pool, chunk);
 
-    if (pthread_mutex_init(&(jobqueue_p->r_w_mutex), 0) != 0) {
-        err("jobqueue_init(): mutex initialisation failed.\n");
-        return -1;
+            if (done == 0)
+                break;
+
+            /* Parts of the batch are queued already, the rest must not fail */
+            batch_run(pool, jobs + done, chunk);
+        }
+
+        done += chunk;
     }
 
-    bsem_init(jobqueue_p->has_jobs, 0);
+    for (size_t i = done; i < n; ++i)
+        thread_pool_free(pool, jobs[i], sizeof(struct job));
 
-    return 0;
+    free(jobs);
+
+    return done;
 }
 
-static void jobqueue_clear(jobqueue *jobqueue_p) {
-    while (jobqueue_p->len) {
-        free(jobqueue_pull(jobqueue_p));
+/* As defer_batch(), for a thread out of the pool, whose jobs are copied into the ring */
+static size_t defer_ring_batch(thread_pool_t *pool, jobqueue *jobqueue_p, runnable_t *runnables, size_t n,
+                               thread_pool_full on_full, batch_room mode) {
+    size_t capacity = ring_capacity(jobqueue_p->ring);
+
+    if (mode == BATCH_ROOM_WHOLE && n > capacity) {
+        atomic_fetch_add_explicit(&jobqueue_p->rejected, 1, memory_order_relaxed);
+        errno = EAGAIN;
+        return 0;
     }
 
-    jobqueue_p->front = NULL;
-    jobqueue_p->rear = NULL;
-    bsem_reset(jobqueue_p->has_jobs);
-    jobqueue_p->len = 0;
-}
+    job *ring_jobs = malloc((n < capacity ? n : capacity) * sizeof(struct job));
 
-static void jobqueue_push(jobqueue *jobqueue_p, job *job_p) {
-    pthread_mutex_lock(&(jobqueue_p->r_w_mutex));
+    if (ring_jobs == NULL) {
+        err("defer_bulk(): Malloc failed for new submitted tasks.\n");
+        return 0;
+    }
 
-    job_p->prev = NULL;
+    uint64_t submitted = submit_time(pool);
+    size_t done = 0;
 
-    switch (jobqueue_p->len) {
-        case 0:
-            jobqueue_p->front = job_p;
-            jobqueue_p->rear = job_p;
-            break;
-        default:
-            jobqueue_p->rear->prev = job_p;
-            jobqueue_p->rear = job_p;
-    }
+    while (done < n) {
+        size_t chunk = n - done;
 
-    jobqueue_p->len += 1;
+        if (mode != BATCH_ROOM_WHOLE) {
+            size_t size = ring_size(jobqueue_p->ring);
 
-    bsem_notifyAll(jobqueue_p->has_jobs);
-    pthread_mutex_unlock(&jobqueue_p->r_w_mutex);
-}
+            chunk = batch_chunk(chunk, size < capacity ? capacity - size : 0);
+        }
 
-static job *jobqueue_pull(jobqueue *jobqueue_p) {
-    pthread_mutex_lock(&jobqueue_p->r_w_mutex);
+        for (size_t i = 0; i < chunk; ++i) {
+            job_init(pool, &ring_jobs[i], runnables[done + i], submitted);
+        }
 
-    job *job_p = jobqueue_p->front;
+        int room = mode == BATCH_ROOM_TRY ? ring_push_jobs(jobqueue_p->ring, ring_jobs, chunk)
+                                          : jobqueue_push_ring(pool, jobqueue_p, ring_jobs, chunk, on_full);
 
-    switch (jobqueue_p->len) {
-        case 0:
-            /* No jobs in the queue */
-            break;
-        case 1:
-            jobqueue_p->front = NULL;
-            jobqueue_p->rear = NULL;
-            jobqueue_p->len = 0;
+        if (room == -1)
             break;
-        default:
-            jobqueue_p->front = job_p->prev;
-            jobqueue_p->len -= 1;
-            bsem_notify(jobqueue_p->has_jobs);
+
+        if (room == 1) {
+            for (size_t i = 0; i < chunk; ++i) {
+                job_run(&ring_jobs[i]);
+            }
+        } else {
+            park_lot_unpark(&pool->idle, chunk);
+        }
+
+        done += chunk;
     }
 
-    pthread_mutex_unlock(&jobqueue_p->r_w_mutex);
+    free(ring_jobs);
 
-    return job_p;
+    return done;
 }
 
-static void jobqueue_destroy(jobqueue *jobqueue_p) {
-    jobqueue_clear(jobqueue_p);
-    free(jobqueue_p->has_jobs);
-}
+/**
+ * Links n jobs into the job queue at once, or publishes them in the deque
+ * of the calling thread of the pool, and wakes up as many threads.
+ * @return 0 on success, -1 if the deque could not take them.
+ */
+static int defer_publish(thread_pool_t *pool, jobqueue *jobqueue_p, job **jobs, size_t n, int local) {
+    if (local) {
+        if (deque_push_bulk(&current_thread->deque, (void **) jobs, n) == -1)
+            return -1;
+    } else {
+        for (size_t i = 1; i < n; ++i)
+            jobs[i - 1]->prev = jobs[i];
+
+        jobqueue_push(jobqueue_p, jobs[0], jobs[n - 1], n);
+    }
 
-/* ================================================================== */
+    park_lot_unpark(&pool->idle, n);
 
+    return 0;
+}
 
-/* ======================== SYNCHRONIZATION ON JOBS ========================= */
+/* Cache of the calling thread in the slabs of the pool */
+static size_t slab_cache_of(thread_pool_t *pool) {
+    if (current_thread != NULL && current_thread->thread_pool_p == pool)
+        return current_thread->id;
+
+    return SLAB_SHARED;
+}
 
-static void bsem_init(bsem *bsem_p, size_t v) {
-    if (v > 1) {
-        err("bsem_init(): Bin Semaphore can be initialised with value 0 or 1.\n");
-        exit(1);
+/* Slab serving blocks of the size, NULL if the size is too big for any */
+static slab *slab_of(thread_pool_t *pool, size_t size) {
+    for (size_t i = 0; i < THREAD_POOL_SLAB_CLASSES; ++i) {
+        if (size <= pool->slabs[i].block_size)
+            return &pool->slabs[i];
     }
 
-    pthread_mutex_init(&bsem_p->mutex, 0);
-    pthread_cond_init(&bsem_p->cond, 0);
-    bsem_p->v = v;
+    return NULL;
 }
 
-static void bsem_reset(bsem *bsem_p) {
-    bsem_init(bsem_p, 0);
+/**
+ * Allocates a block of memory which is recycled by the thread pool after
+ * thread_pool_free(). Threads of the pool allocate from their own caches
+ * without any locking. Blocks bigger than the biggest size class are malloc-ed.
+ * @param pool - pointer on the thread_pool
+ * @param size - size of the block
+ * @return pointer to the block, NULL if malloc failed.
+ */
+void *thread_pool_alloc(thread_pool_t *pool, size_t size) {
+    slab *slab_p = slab_of(pool, size);
+
+    if (slab_p == NULL)
+        return malloc(size);
+
+    return slab_alloc(slab_p, slab_cache_of(pool));
 }
 
-static void bsem_wait(bsem *bsem_p) {
-    pthread_mutex_lock(&bsem_p->mutex);
+/**
+ * Frees a block allocated with thread_pool_alloc(), from any thread.
+ * @param pool  - pointer on the thread_pool
+ * @param block - pointer to the block
+ * @param size  - size the block was allocated with
+ */
+void thread_pool_free(thread_pool_t *pool, void *block, size_t size) {
+    slab *slab_p = slab_of(pool, size);
 
-    while (bsem_p->v != 1) {
-        pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
+    if (slab_p == NULL) {
+        free(block);
+        return;
     }
 
-    bsem_p->v = 0;
-    pthread_mutex_unlock(&bsem_p->mutex);
+    slab_free(slab_p, slab_cache_of(pool), block);
 }
 
-/* Notify one thread waiting to get a job */
-static void bsem_notify(bsem *bsem_p) {
-    pthread_mutex_lock(&bsem_p->mutex);
-    bsem_p->v = 1;
-    pthread_cond_signal(&bsem_p->cond);
-    pthread_mutex_unlock(&bsem_p->mutex);
-}
+/**
+ * Fills stats with a snapshot of the counters of the thread pool.
+ * Counters of every thread are read without stopping it, so the snapshot
+ * is consistent per counter only. Histograms hold every metrics_sample-th
+ * job deferred by a thread, or no job at all if the option is 0.
+ * @param pool  - pointer on the thread_pool
+ * @param stats - pointer on the stats to be filled
+ */
+void thread_pool_stats(thread_pool_t *pool, thread_pool_stats_t *stats) {
+    stats->slab_hits = 0;
+    stats->slab_misses = 0;
+    stats->num_threads = atomic_load_explicit(&pool->num_threads_alive, memory_order_relaxed);
+    stats->num_threads_working = atomic_load_explicit(&pool->num_threads_working, memory_order_relaxed);
+    stats->queue_depth = jobqueues_len(pool);
+    stats->submits_blocked = 0;
+    stats->submits_rejected = 0;
+    stats->submits_caller_ran = 0;
+
+    for (size_t prio = 0; prio < THREAD_POOL_PRIORITIES; ++prio) {
+        jobqueue *jobqueue_p = &pool->jobqueue[prio];
+
+        stats->submits_blocked += atomic_load_explicit(&jobqueue_p->blocked, memory_order_relaxed);
+        stats->submits_rejected += atomic_load_explicit(&jobqueue_p->rejected, memory_order_relaxed);
+        stats->submits_caller_ran += atomic_load_explicit(&jobqueue_p->caller_ran, memory_order_relaxed);
+    }
 
-/* Notify all threads */
-static void bsem_notifyAll(bsem *bsem_p) {
-    pthread_mutex_lock(&bsem_p->mutex);
-    bsem_p->v = 1;
-    pthread_cond_broadcast(&bsem_p->cond);
-    pthread_mutex_unlock(&bsem_p->mutex);
-}
+    stats->tasks_executed = 0;
+    stats->tasks_stolen = 0;
+    stats->idle_ns = 0;
+    histogram_init(&stats->queue_wait);
+    histogram_init(&stats->exec);
+
+    for (size_t i = 0; i < pool->num_threads; ++i) {
+        thread_metrics *metrics = &pool->threads[i]->metrics;
+
+        stats->queue_depth += deque_size(&pool->threads[i]->deque);
+        stats->tasks_executed += atomic_load_explicit(&metrics->executed, memory_order_relaxed);
+        stats->tasks_stolen += atomic_load_explicit(&metrics->stolen, memory_order_relaxed);
+        stats->idle_ns += atomic_load_explicit(&metrics->idle_ns, memory_order_relaxed);
+        histogram_add(&stats->queue_wait, &metrics->queue_wait);
+        histogram_add(&stats->exec, &metrics->exec);
+    }
 
-/* ========================================================================== */
+    for (size_t i = 0; i < THREAD_POOL_SLAB_CLASSES; ++i) {
+        size_t hits, misses;
+        slab_stats(&pool->slabs[i], &hits, &misses);
 
+        stats->slab_hits += hits;
+        stats->slab_misses += misses;
+    }
+}
+
+/**
+ * No thread holds or looks for a job and there are no jobs left, nor timers
+ * which are to be run once. Read in the order jobs travel backwards: a job
+ * leaves the wheel only once it is in a queue, and the queue only for
+ * a thread counted as working until it is done.
+ */
+static int thread_pool_is_idle(thread_pool_t *pool) {
+    return atomic_load(&pool->timers_pending) == 0 && jobqueues_len(pool) == 0 &&
+           atomic_load(&pool->num_threads_working) == 0;
+}
+
+/**
+ * Blocks until the queue is empty and no thread runs a job, or until
+ * the timeout. The waiting thread sleeps on threads_idle, which the last
+ * thread to park signals as long as idle_waiters says anybody waits,
+ * so the threads pay nothing for it otherwise.
+ * @param pool       - pointer on the thread_pool
+ * @param timeout_ns - relative timeout in nanoseconds, or NULL to wait forever
+ * @return 0 once idle, -1 with errno ETIMEDOUT after the timeout, or with
+ *         errno EDEADLK if called from a thread of the pool.
+ */
+static int thread_pool_wait_idle_until(thread_pool_t *pool, const uint64_t *timeout_ns) {
+    if (current_thread != NULL && current_thread->thread_pool_p == pool) {
+        err("thread_pool_wait_idle(): A thread of the pool would wait for itself.\n");
+        errno = EDEADLK;
+        return -1;
+    }
+
+    struct timespec deadline;
+
+    if (timeout_ns != NULL) {
+        uint64_t at = monotonic_ns() + *timeout_ns;
+
+        deadline.tv_sec = (time_t) (at / 1000000000u);
+        deadline.tv_nsec = (long) (at % 1000000000u);
+    }
+
+    int ret = 0;
+
+    atomic_fetch_add(&pool->idle_waiters, 1);
+    pthread_mutex_lock(&pool->thcount_lock);
+
+    while (!thread_pool_is_idle(pool)) {
+        if (timeout_ns == NULL) {
+            pthread_cond_wait(&pool->threads_idle, &pool->thcount_lock);
+        } else if (pthread_cond_timedwait(&pool->threads_idle, &pool->thcount_lock, &deadline) == ETIMEDOUT) {
+            if (!thread_pool_is_idle(pool)) {
+                errno = ETIMEDOUT;
+                ret = -1;
+            }
+
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->thcount_lock);
+    atomic_fetch_sub(&pool->idle_waiters, 1);
+
+    return ret;
+}
+
+/**
+ * Blocks until every deferred task is done: the queue is empty and no
+ * thread of the pool runs a task. Must not be called from a task of the pool.
+ * @param pool - pointer on the thread_pool
+ * @return 0 on success, -1 with errno EDEADLK if called from a thread of the pool.
+ */
+int thread_pool_wait_idle(thread_pool_t *pool) {
+    return thread_pool_wait_idle_until(pool, NULL);
+}
+
+/**
+ * As thread_pool_wait_idle(), but gives up after timeout_ns nanoseconds.
+ * @param pool       - pointer on the thread_pool
+ * @param timeout_ns - timeout in nanoseconds, measured on CLOCK_MONOTONIC
+ * @return 0 on success, -1 with errno ETIMEDOUT if the pool was still busy.
+ */
+int thread_pool_wait_idle_timeout(thread_pool_t *pool, uint64_t timeout_ns) {
+    return thread_pool_wait_idle_until(pool, &timeout_ns);
+}
+
+/**
+ * Runs one job of the thread pool of the calling thread, if it is a thread
+ * of a thread pool at all. A pool thread which waits for a result inside
+ * of a job calls it to help with the other jobs instead of sleeping,
+ * so nested waits on a small pool neither deadlock nor waste the thread.
+ * @return 1 if a job was run, 0 if none was found,
+ *         -1 if the calling thread does not belong to a thread pool.
+ */
+int thread_pool_help(void) {
+    thread *thread_p = current_thread;
+
+    if (thread_p == NULL)
+        return -1;
+
+    /* The job of the caller may be the one in thread_p->ring_job, it must not be overwritten */
+    job ring_job;
+    job *job_p = thread_find_job(thread_p, &ring_job);
+
+    if (job_p == NULL)
+        return 0;
+
+    thread_run_job(thread_p, job_p, &ring_job);
+
+    return 1;
+}
+
+/* ================================================================== */
+
+/* ============================ THREAD ============================== */
+
+/* Fills the job, copying a small argument into it in inline_args mode */
+static void job_init(thread_pool_t *pool, job *job_p, runnable_t runnable, uint64_t submitted) {
+    job_p->prev = NULL;
+    job_p->job = runnable;
+    job_p->submitted = submitted;
+    job_p->inline_arg = pool->options.inline_args && runnable.arg != NULL &&
+                        runnable.argsz > 0 && runnable.argsz <= THREAD_POOL_INLINE_ARG_SIZE;
+
+    if (job_p->inline_arg)
+        memcpy(job_p->args, runnable.arg, runnable.argsz);
+}
+
+/* Jobs are copied in and out of the ring, so the copied argument is looked up only now */
+static void job_run(job *job_p) {
+    void *arg = job_p->inline_arg ? job_p->args : job_p->job.arg;
+
+    job_p->job.function(arg, job_p->job.argsz);
+}
+
+/* Time of the submission of a job, taken for every metrics_sample-th job of the calling thread */
+static uint64_t submit_time(thread_pool_t *pool) {
+    static __thread unsigned int submitted = 0;
+
+    if (pool->options.metrics_sample == 0 || ++submitted < pool->options.metrics_sample)
+        return 0;
+
+    submitted = 0;
+
+    return monotonic_ns();
+}
+
+/* Counters of the metrics are written by their thread only, a plain increment is enough */
+static void counter_add(atomic_size_t *counter, size_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/**
+ * Runs the job found by the thread, records its metrics and frees it.
+ * @param thread_p - pointer to the thread.
+ * @param job_p    - pointer to the job.
+ * @param ring_job - buffer the job may have been copied to, which is not freed.
+ */
+static void thread_run_job(thread *thread_p, job *job_p, job *ring_job) {
+    thread_pool_t *pool = thread_p->thread_pool_p;
+
+    if (job_p->submitted != 0) {
+        uint64_t start = monotonic_ns();
+        uint64_t wait = start - job_p->submitted;
+
+        histogram_record(&thread_p->metrics.queue_wait, wait);
+
+        if (wait > pool->options.grow_wait_ns)
+            thread_pool_grow(pool, start);
+
+        job_run(job_p);
+        histogram_record(&thread_p->metrics.exec, monotonic_ns() - start);
+    } else {
+        job_run(job_p);
+    }
+
+    counter_add(&thread_p->metrics.executed, 1);
+
+    if (job_p != ring_job)
+        thread_pool_free(pool, job_p, sizeof(struct job));
+}
+
+static int thread_init(thread_pool_t *pool, thread **thread_p, size_t id) {
+    /* Deque and metrics are cache line aligned */
+    *thread_p = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct thread));
+
+    if (*thread_p == NULL) {
+        err("thread_init(): Malloc failed for thread initialisation.\n");
+        return -1;
+    }
+
+    (*thread_p)->thread_pool_p = pool;
+    (*thread_p)->id = id;
+    (*thread_p)->seed = (unsigned int) id * 2654435761u + 1;
+    (*thread_p)->spin = 0;
+    (*thread_p)->aging = 0;
+    (*thread_p)->alive = false;
+    (*thread_p)->joinable = false;
+    (*thread_p)->pinned = false;
+    (*thread_p)->victims = NULL;
+    (*thread_p)->victim_distance = NULL;
+    atomic_init(&(*thread_p)->park.state, PARK_RUNNING);
+    atomic_init(&(*thread_p)->metrics.executed, 0);
+    atomic_init(&(*thread_p)->metrics.stolen, 0);
+    atomic_init(&(*thread_p)->metrics.idle_ns, 0);
+    histogram_init(&(*thread_p)->metrics.queue_wait);
+    histogram_init(&(*thread_p)->metrics.exec);
+
+    if (deque_init(&(*thread_p)->deque) == -1) {
+        err("thread_init(): Initialising deque failed.\n");
+        free(*thread_p);
+        *thread_p = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Threads are joinable, thread_pool_destroy() joins them once they ran out of jobs */
+static int thread_start(thread *thread_p) {
+    const thread_pool_options_t *options = &thread_p->thread_pool_p->options;
+    pthread_attr_t attr;
+    int ret = 0;
+
+    pthread_attr_init(&attr);
+
+    if (options->stack_size != 0 && pthread_attr_setstacksize(&attr, options->stack_size) != 0) {
+        err("thread_start(): Invalid stack size.\n");
+        ret = -1;
+    }
+
+    if (ret == 0 && thread_p->pinned && topology_attr_affinity(&attr, &thread_p->cpus) == -1) {
+        err("thread_start(): Setting CPU affinity failed.\n");
+        ret = -1;
+    }
+
+    if (ret == 0 && pthread_create(&thread_p->pthread, &attr, (void *) thread_do, thread_p) != 0)
+        ret = -1;
+
+    pthread_attr_destroy(&attr);
+
+    return ret;
+}
+
+/**
+ * Places the threads on the CPUs, as set by the pin and numa_node options.
+ * The CPUs the process may run on are taken node by node, one for each
+ * thread in turn, and a thread is pinned to that CPU or to its whole node.
+ * Then the other slots are ordered by the distance of their node into the
+ * steal victims of every thread. Threads which are not pinned may run
+ * anywhere, so to them all victims are equally near.
+ * @param pool - pointer to the thread pool, whose threads are initialised.
+ * @return 0 on success, -1 if there is no CPU to run on.
+ */
+static int thread_pool_place(thread_pool_t *pool) {
+    size_t slots = pool->num_threads;
+    thread_pool_pin pin = pool->options.pin;
+    int numa_node = pool->options.numa_node;
+    int *node = calloc(slots ? slots : 1, sizeof(int));
+    topology *topo = NULL;
+
+    if (node == NULL) {
+        err("thread_pool_place(): Malloc failed for nodes.\n");
+        return -1;
+    }
+
+    /* A pool local to a node runs on its CPUs at least */
+    if (pin == THREAD_POOL_PIN_NONE && numa_node >= 0)
+        pin = THREAD_POOL_PIN_NODE;
+
+    if (pin != THREAD_POOL_PIN_NONE) {
+        topo = malloc(sizeof(struct topology));
+
+        if (topo == NULL || topology_discover(topo) == -1) {
+            err("thread_pool_place(): Discovering the topology failed.\n");
+            free(topo);
+            free(node);
+            return -1;
+        }
+
+        size_t num_cpus = 0;
+
+        for (size_t i = 0; i < topo->num_cpus; ++i) {
+            if (numa_node < 0 || topo->cpu_node[i] == numa_node) {
+                topo->cpus[num_cpus] = topo->cpus[i];
+                topo->cpu_node[num_cpus] = topo->cpu_node[i];
+                ++num_cpus;
+            }
+        }
+
+        if (num_cpus == 0) {
+            err("thread_pool_place(): No CPU on the NUMA node.\n");
+            free(topo);
+            free(node);
+            return -1;
+        }
+
+        for (size_t i = 0; i < slots; ++i) {
+            thread *thread_p = pool->threads[i];
+            size_t cpu = i % num_cpus;
+
+            node[i] = topo->cpu_node[cpu];
+            cpu_mask_zero(&thread_p->cpus);
+
+            for (size_t j = 0; j < num_cpus; ++j) {
+                if (j == cpu || (pin == THREAD_POOL_PIN_NODE && topo->cpu_node[j] == node[i]))
+                    cpu_mask_set(&thread_p->cpus, topo->cpus[j]);
+            }
+
+            thread_p->pinned = true;
+        }
+    }
+
+    for (size_t i = 0; i < slots; ++i) {
+        thread *thread_p = pool->threads[i];
+        size_t count[UCHAR_MAX + 1] = {0};
+
+        thread_p->victims = malloc((slots ? slots : 1) * sizeof(size_t));
+        thread_p->victim_distance = malloc(slots ? slots : 1);
+
+        if (thread_p->victims == NULL || thread_p->victim_distance == NULL) {
+            err("thread_pool_place(): Malloc failed for victims.\n");
+            free(topo);
+            free(node);
+            return -1;
+        }
+
+        /* Counting sort of the other slots by distance, stable in the order of the slots */
+        for (size_t j = 0; j < slots; ++j) {
+            if (j != i)
+                count[topo != NULL ? topo->distance[node[i]][node[j]] : 0]++;
+        }
+
+        for (size_t d = 0, sum = 0; d <= UCHAR_MAX; ++d) {
+            size_t c = count[d];
+
+            count[d] = sum;
+            sum += c;
+        }
+
+        for (size_t j = 0; j < slots; ++j) {
+            if (j == i)
+                continue;
+
+            unsigned char distance = topo != NULL ? topo->distance[node[i]][node[j]] : 0;
+            size_t at = count[distance]++;
+
+            thread_p->victims[at] = j;
+            thread_p->victim_distance[at] = distance;
+        }
+    }
+
+    free(topo);
+    free(node);
+
+    return 0;
+}
+
+/* Just frees the allocated memory for a thread struct */
+static void thread_destroy(thread *thread_p) {
+    deque_destroy(&thread_p->deque);
+    free(thread_p->victims);
+    free(thread_p->victim_distance);
+    free(thread_p);
+}
+
+/**
+ * Function blocks SIGINT signal for the current thread.
+ */
+static void mask_sig(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+/**
+ * Looks for a job of one priority level. Jobs of normal priority are looked
+ * for first in the thread's own deque (newest job), then in the shared job
+ * queue and at last in the deques of the other threads (oldest job),
+ * starting from a random victim. The other levels have their queue only.
+ * @param thread_p - pointer to the thread looking for a job.
+ * @param prio     - priority level of the job.
+ * @param ring_job - in ring mode, a job from the shared queue is copied here.
+ * @return pointer to the job, or NULL if no job was found.
+ */
+static job *thread_find_level(thread *thread_p, thread_pool_prio prio, job *ring_job) {
+    thread_pool_t *pool = thread_p->thread_pool_p;
+    jobqueue *jobqueue_p = &pool->jobqueue[prio];
+    job *job_p;
+
+    if (prio == THREAD_POOL_PRIO_NORMAL && (job_p = deque_pop(&thread_p->deque)) != NULL) {
+        pool_room_release(pool, 1);
+        return job_p;
+    }
+
+    if (jobqueue_len(jobqueue_p) != 0) {
+        job_p = jobqueue_pull(jobqueue_p, ring_job);
+
+        /* Jobs copied out of the ring had room of their own */
+        if (job_p != NULL && job_p != ring_job)
+            pool_room_release(pool, 1);
+
+        if (job_p != NULL)
+            return job_p;
+    }
+
+    if (prio != THREAD_POOL_PRIO_NORMAL)
+        return NULL;
+
+    size_t num_victims = pool->num_threads - 1;
+    int aborted;
+
+    do {
+        aborted = 0;
+
+        /* Nearer victims first, those at the same distance from a random one */
+        for (size_t first = 0, last; first < num_victims; first = last) {
+            for (last = first + 1; last < num_victims &&
+                                   thread_p->victim_distance[last] == thread_p->victim_distance[first]; ++last);
+
+            size_t run = last - first;
+            size_t start = (size_t) rand_r(&thread_p->seed);
+
+            for (size_t i = 0; i < run; ++i) {
+                thread *victim = pool->threads[thread_p->victims[first + (start + i) % run]];
+                void *stolen;
+
+                switch (deque_steal(&victim->deque, &stolen)) {
+                    case DEQUE_OK:
+                        counter_add(&thread_p->metrics.stolen, 1);
+                        pool_room_release(pool, 1);
+                        return stolen;
+                    case DEQUE_ABORT:
+                        aborted = 1;
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+    } while (aborted);
+
+    return NULL;
+}
+
+/**
+ * Looks for a job to run, in the order of the priority levels. Every
+ * THREAD_POOL_AGING_ROUNDS-th time the order is reversed, so jobs of
+ * a lower level are run even under a flood of jobs of the higher ones.
+ * @param thread_p - pointer to the thread looking for a job.
+ * @param ring_job - in ring mode, a job from the shared queue is copied here.
+ * @return pointer to the job, or NULL if no job was found.
+ */
+static job *thread_find_job(thread *thread_p, job *ring_job) {
+    job *job_p;
+
+    if (++thread_p->aging == THREAD_POOL_AGING_ROUNDS) {
+        thread_p->aging = 0;
+
+        for (size_t prio = THREAD_POOL_PRIORITIES; prio-- > 0;) {
+            if ((job_p = thread_find_level(thread_p, (thread_pool_prio) prio, ring_job)) != NULL)
+                return job_p;
+        }
+
+        return NULL;
+    }
+
+    for (size_t prio = 0; prio < THREAD_POOL_PRIORITIES; ++prio) {
+        if ((job_p = thread_find_level(thread_p, (thread_pool_prio) prio, ring_job)) != NULL)
+            return job_p;
+    }
+
+    return NULL;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Leaves the working threads before parking. A thread holds no job and
+ * looks for none while it is not counted, so when the last thread leaves
+ * and the queue is empty, the pool is idle. Only then, and only if
+ * a thread waits for it, threads_idle is signalled.
+ */
+static void thread_going_idle(thread_pool_t *pool) {
+    if (atomic_fetch_sub(&pool->num_threads_working, 1) != 1)
+        return;
+
+    thread_pool_signal_idle(pool);
+}
+
+/* Wakes up the threads in thread_pool_wait_idle(), if any, to check if the pool is idle */
+static void thread_pool_signal_idle(thread_pool_t *pool) {
+    if (atomic_load(&pool->idle_waiters) == 0)
+        return;
+
+    pthread_mutex_lock(&pool->thcount_lock);
+    pthread_cond_broadcast(&pool->threads_idle);
+    pthread_mutex_unlock(&pool->thcount_lock);
+}
+
+/**
+ * Waits for a job. The thread first keeps looking for one for a few rounds,
+ * then parks in the idle lot until a job is deferred. The number of rounds adapts:
+ * it grows when a job came shortly after parking, so spinning would have
+ * caught it, and shrinks when spinning found nothing. In an elastic pool,
+ * the thread parks for keep_alive_ns at most, then it may retire.
+ * @param thread_p - pointer to the waiting thread.
+ * @param retired  - set to 1 if the thread retired, otherwise 0.
+ * @return pointer to the job, or NULL if the thread pool is being
+ *         destroyed and there are no jobs left, or the thread retired.
+ */
+static job *thread_wait_job(thread *thread_p, int *retired) {
+    thread_pool_t *pool = thread_p->thread_pool_p;
+    job *job_p;
+
+    for (unsigned int i = 0; i < thread_p->spin; ++i) {
+        cpu_relax();
+
+        if ((job_p = thread_find_job(thread_p, &thread_p->ring_job)) != NULL)
+            return job_p;
+    }
+
+    thread_p->spin /= 2;
+
+    for (;;) {
+        park_lot_prepare(&pool->idle, &thread_p->park);
+
+        if ((job_p = thread_find_job(thread_p, &thread_p->ring_job)) != NULL) {
+            park_lot_cancel(&pool->idle, &thread_p->park);
+            return job_p;
+        }
+
+        if (!atomic_load(&pool->keepAlive)) {
+            park_lot_cancel(&pool->idle, &thread_p->park);
+            return NULL;
+        }
+
+        uint64_t parked = monotonic_ns();
+
+        int timed_out = 0;
+
+        thread_going_idle(pool);
+
+        if (pool->num_threads > pool->options.num_threads)
+            timed_out = park_lot_wait_timeout(&pool->idle, &thread_p->park, pool->options.keep_alive_ns) == -1;
+        else
+            park_slot_wait(&thread_p->park);
+
+        atomic_fetch_add(&pool->num_threads_working, 1);
+
+        uint64_t idle = monotonic_ns() - parked;
+
+        atomic_store_explicit(&thread_p->metrics.idle_ns,
+                              atomic_load_explicit(&thread_p->metrics.idle_ns, memory_order_relaxed) + idle,
+                              memory_order_relaxed);
+
+        if (timed_out && thread_retire(thread_p)) {
+            *retired = 1;
+            return NULL;
+        }
+
+        if ((job_p = thread_find_job(thread_p, &thread_p->ring_job)) != NULL) {
+            if (idle < THREAD_POOL_SPIN_PAYOFF_NS) {
+                thread_p->spin = thread_p->spin * 2 + 1;
+
+                if (thread_p->spin > pool->spin_max)
+                    thread_p->spin = pool->spin_max;
+            }
+
+            return job_p;
+        }
+    }
+}
+
+/**
+ * Ends the thread after it was idle for keep_alive_ns, unless the pool would
+ * have less than num_threads threads. The thread leaves the counts here, under
+ * thcount_lock, so thread_pool_grow() may join it while holding the lock.
+ * @return 1 if the thread is to end, otherwise 0.
+ */
+static int thread_retire(thread *thread_p) {
+    thread_pool_t *pool = thread_p->thread_pool_p;
+    int retire = 0;
+
+    pthread_mutex_lock(&pool->thcount_lock);
+
+    if (atomic_load(&pool->num_threads_alive) > pool->options.num_threads) {
+        thread_p->alive = false;
+        atomic_fetch_sub(&pool->num_threads_alive, 1);
+        retire = 1;
+
+        if (atomic_fetch_sub(&pool->num_threads_working, 1) == 1 && atomic_load(&pool->idle_waiters) != 0)
+            pthread_cond_broadcast(&pool->threads_idle);
+    }
+
+    pthread_mutex_unlock(&pool->thcount_lock);
+
+    return retire;
+}
+
+/**
+ * Starts a thread in a free slot of an elastic pool, as a timed job waited
+ * for longer than grow_wait_ns. Threads are started one per grow_wait_ns at most,
+ * so the ones started already have a chance to catch up with the queue.
+ * @param pool - pointer to the thread pool.
+ * @param now  - current time.
+ */
+static void thread_pool_grow(thread_pool_t *pool, uint64_t now) {
+    if (atomic_load_explicit(&pool->num_threads_alive, memory_order_relaxed) >= pool->num_threads)
+        return;
+
+    uint64_t last = atomic_load_explicit(&pool->last_grow, memory_order_relaxed);
+
+    if (now - last < pool->options.grow_wait_ns || !atomic_compare_exchange_strong(&pool->last_grow, &last, now))
+        return;
+
+    pthread_mutex_lock(&pool->thcount_lock);
+
+    for (size_t i = 0; i < pool->num_threads && atomic_load(&pool->keepAlive) &&
+                       atomic_load(&pool->num_threads_alive) < pool->num_threads; ++i) {
+        thread *thread_p = pool->threads[i];
+
+        if (thread_p->alive)
+            continue;
+
+        /* The retired thread of the slot left the pool already, it just may not have ended yet */
+        if (thread_p->joinable) {
+            pthread_join(thread_p->pthread, NULL);
+            thread_p->joinable = false;
+        }
+
+        thread_p->alive = true;
+
+        if (thread_start(thread_p) == -1) {
+            err("thread_pool_grow(): Starting a thread failed.\n");
+            thread_p->alive = false;
+            break;
+        }
+
+        thread_p->joinable = true;
+        atomic_fetch_add(&pool->num_threads_alive, 1);
+        break;
+    }
+
+    pthread_mutex_unlock(&pool->thcount_lock);
+}
+
+static void *thread_do(thread *thread_p) {
+    /* SIGINT should be blocked for thread_pool threads. */
+    mask_sig();
+
+    thread_pool_t *pool = thread_p->thread_pool_p;
+    current_thread = thread_p;
+
+    atomic_fetch_add(&pool->num_threads_working, 1);
+
+    int retired = 0;
+
+    /* keepAlive will be set to 0 while destroying the thread pool of the thread,
+     * the thread still runs every job it can find before it ends. */
+    for (;;) {
+        job *job_p = thread_find_job(thread_p, &thread_p->ring_job);
+
+        if (job_p == NULL && (job_p = thread_wait_job(thread_p, &retired)) == NULL)
+            break;
+
+        /* Process the job */
+        thread_run_job(thread_p, job_p, &thread_p->ring_job);
+    }
+
+    /* A retired thread left the counts already, it must not touch the pool any more */
+    if (!retired)
+        thread_going_idle(pool);
+
+    current_thread = NULL;
+
+    /* NULL on SUCCESS, thread function should be of type (void *) */
+    return NULL;
+}
+
+/* ================================================================== */
+
+/* ============================= TIMERS ============================= */
+
+/**
+ * Puts a job into the timer wheel, starting the timer thread with the first one.
+ * @param delay_ns  - time until the job is deferred the first time.
+ * @param period_ns - time between the runs, 0 for a job run once.
+ * @return 0 on success, otherwise -1.
+ */
+static int timer_schedule(thread_pool_t *pool, runnable_t runnable, uint64_t delay_ns, uint64_t period_ns) {
+    if (pool == NULL) {
+        err("defer_after(): defer_after is called on null pointer.\n");
+        return -1;
+    }
+
+    if (atomic_load(&pool->keepAlive) == 0) {
+        err("defer_after(): After thread_pool_destroy defer_after is called.\n");
+        return -1;
+    }
+
+    scheduled_job *job_p = thread_pool_alloc(pool, sizeof(struct scheduled_job));
+
+    if (job_p == NULL) {
+        err("defer_after(): Malloc failed for new scheduled task.\n");
+        return -1;
+    }
+
+    job_p->runnable = runnable;
+    job_p->period = (period_ns + THREAD_POOL_TIMER_TICK_NS - 1) / THREAD_POOL_TIMER_TICK_NS;
+    job_p->timer.expires = (monotonic_ns() + delay_ns + THREAD_POOL_TIMER_TICK_NS - 1) / THREAD_POOL_TIMER_TICK_NS;
+
+    /* The job is copied by defer() only when it expires, the argument is copied for it now */
+    if (pool->options.inline_args && runnable.arg != NULL &&
+        runnable.argsz > 0 && runnable.argsz <= THREAD_POOL_INLINE_ARG_SIZE) {
+        memcpy(job_p->args, runnable.arg, runnable.argsz);
+        job_p->runnable.arg = job_p->args;
+    }
+
+    pthread_mutex_lock(&pool->timer_lock);
+
+    if (pool->timer_stop) {
+        pthread_mutex_unlock(&pool->timer_lock);
+        err("defer_after(): After thread_pool_destroy defer_after is called.\n");
+        thread_pool_free(pool, job_p, sizeof(struct scheduled_job));
+        return -1;
+    }
+
+    if (!pool->timer_started) {
+        if (pthread_create(&pool->timer_thread, NULL, (void *) timer_do, pool) != 0) {
+            pthread_mutex_unlock(&pool->timer_lock);
+            err("defer_after(): Starting the timer thread failed.\n");
+            thread_pool_free(pool, job_p, sizeof(struct scheduled_job));
+            return -1;
+        }
+
+        pool->timer_started = true;
+    }
+
+    if (job_p->period == 0)
+        atomic_fetch_add(&pool->timers_pending, 1);
+
+    timer_wheel_add(&pool->wheel, &job_p->timer);
+
+    if (job_p->timer.expires < pool->timer_wake)
+        pthread_cond_signal(&pool->timer_cond);
+
+    pthread_mutex_unlock(&pool->timer_lock);
+
+    return 0;
+}
+
+/**
+ * Defers the jobs of the expired timers, THREAD_POOL_TIMER_BATCH at once,
+ * then puts the periodic ones back into the wheel and frees the others.
+ * The timer thread neither waits for room nor runs jobs itself, whatever
+ * the on_full option, as every other timer would wait for it. Jobs which
+ * find the queue full stay in the wheel, to be deferred on the next tick.
+ * These retries are not submissions of the user, so the stats count none of them.
+ * @param pool    - pointer to the thread pool.
+ * @param expired - list of the expired timers, taken out of the wheel.
+ */
+static void timer_defer_expired(thread_pool_t *pool, timer *expired) {
+    scheduled_job *batch[THREAD_POOL_TIMER_BATCH];
+    runnable_t runnables[THREAD_POOL_TIMER_BATCH];
+
+    while (expired != NULL) {
+        size_t n = 0;
+
+        for (; expired != NULL && n < THREAD_POOL_TIMER_BATCH; expired = expired->next) {
+            batch[n] = (scheduled_job *) expired;
+            runnables[n] = batch[n]->runnable;
+            ++n;
+        }
+
+        size_t queued = defer_batch(pool, runnables, n, 0, THREAD_POOL_FULL_ERROR, BATCH_ROOM_TRY);
+        uint64_t now = monotonic_ns() / THREAD_POOL_TIMER_TICK_NS;
+        size_t done = 0;
+
+        pthread_mutex_lock(&pool->timer_lock);
+
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t period = batch[i]->period;
+
+            /* Expires on the next tick of the wheel */
+            if (i >= queued) {
+                batch[i]->timer.expires = 0;
+                timer_wheel_add(&pool->wheel, &batch[i]->timer);
+                continue;
+            }
+
+            if (period == 0)
+                continue;
+
+            batch[i]->timer.expires += period;
+
+            if (batch[i]->timer.expires <= now)
+                batch[i]->timer.expires += (now - batch[i]->timer.expires) / period * period + period;
+
+            timer_wheel_add(&pool->wheel, &batch[i]->timer);
+        }
+
+        pthread_mutex_unlock(&pool->timer_lock);
+
+        for (size_t i = 0; i < queued; ++i) {
+            if (batch[i]->period == 0) {
+                thread_pool_free(pool, batch[i], sizeof(struct scheduled_job));
+                ++done;
+            }
+        }
+
+        /* Only now the jobs are in the queue, thread_pool_is_idle() must not miss them */
+        if (done > 0 && atomic_fetch_sub(&pool->timers_pending, done) == done)
+            thread_pool_signal_idle(pool);
+    }
+}
+
+/**
+ * Timer thread of the pool: sleeps until the next tick on which a timer of
+ * the wheel may expire, then defers the jobs of the expired timers.
+ */
+static void *timer_do(thread_pool_t *pool) {
+    /* SIGINT should be blocked for thread_pool threads. */
+    mask_sig();
+
+    pthread_mutex_lock(&pool->timer_lock);
+
+    while (!pool->timer_stop) {
+        timer *expired = timer_wheel_advance(&pool->wheel, monotonic_ns() / THREAD_POOL_TIMER_TICK_NS);
+
+        if (expired != NULL) {
+            pthread_mutex_unlock(&pool->timer_lock);
+            timer_defer_expired(pool, expired);
+            pthread_mutex_lock(&pool->timer_lock);
+            continue;
+        }
+
+        /* Timers added meanwhile signal the thread only if they expire before it wakes up */
+        pool->timer_wake = timer_wheel_next(&pool->wheel);
+
+        if (pool->timer_wake == UINT64_MAX) {
+            pthread_cond_wait(&pool->timer_cond, &pool->timer_lock);
+        } else {
+            uint64_t at = pool->timer_wake * THREAD_POOL_TIMER_TICK_NS;
+            struct timespec deadline = {.tv_sec = (time_t) (at / 1000000000u), .tv_nsec = (long) (at % 1000000000u)};
+
+            pthread_cond_timedwait(&pool->timer_cond, &pool->timer_lock, &deadline);
+        }
+
+        pool->timer_wake = 0;
+    }
+
+    pthread_mutex_unlock(&pool->timer_lock);
+
+    return NULL;
+}
+
+/* Ends the timer thread, if it was started, and frees the timers left in the wheel */
+static void timer_stop(thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->timer_lock);
+
+    bool started = pool->timer_started;
+
+    pool->timer_stop = true;
+    pthread_cond_signal(&pool->timer_cond);
+    pthread_mutex_unlock(&pool->timer_lock);
+
+    if (started)
+        pthread_join(pool->timer_thread, NULL);
+
+    timer *timer_p = timer_wheel_clear(&pool->wheel);
+
+    while (timer_p != NULL) {
+        timer *next = timer_p->next;
+
+        thread_pool_free(pool, timer_p, sizeof(struct scheduled_job));
+        timer_p = next;
+    }
+
+    atomic_store(&pool->timers_pending, 0);
+}
+
+/* ================================================================== */
+
+/* ============================ PARALLEL ============================ */
+
+/* A pool thread waiting for the pieces of its loop looks for jobs to help with this often */
+#define PARALLEL_HELP_WAIT_NS 100000L
+
+/**
+ * Tells whether a piece of a loop would be taken by another thread now:
+ * the deque of a pool thread, or the queue for any other thread, is empty.
+ * Splitting only then keeps the pieces few and as big as the load allows.
+ */
+static bool parallel_hungry(thread_pool_t *pool) {
+    thread *thread_p = current_thread;
+
+    if (thread_p != NULL && thread_p->thread_pool_p == pool)
+        return deque_size(&thread_p->deque) == 0;
+
+    return jobqueue_len(&pool->jobqueue[THREAD_POOL_PRIO_NORMAL]) == 0;
+}
+
+/* Defers the indices begin to end - 1 of the loop as a piece of their own */
+static int parallel_spawn(parallel_loop *loop, size_t begin, size_t end) {
+    parallel_piece *piece = thread_pool_alloc(loop->pool, sizeof(parallel_piece));
+
+    if (piece == NULL)
+        return -1;
+
+    piece->loop = loop;
+    piece->begin = begin;
+    piece->end = end;
+
+    atomic_fetch_add_explicit(&loop->pending, 1, memory_order_relaxed);
+
+    runnable_t runnable = {.function = parallel_piece_run, .arg = piece, .argsz = 0};
+
+    if (defer(loop->pool, runnable) != 0) {
+        atomic_fetch_sub_explicit(&loop->pending, 1, memory_order_relaxed);
+        thread_pool_free(loop->pool, piece, sizeof(parallel_piece));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Runs the indices begin to end - 1 of the loop grain by grain, with lazy
+ * binary splitting: before each grain, if another thread would take it,
+ * the upper half of what is left is deferred as a piece.
+ */
+static void parallel_run(parallel_loop *loop, size_t begin, size_t end) {
+    _Alignas(max_align_t) unsigned char acc[THREAD_POOL_REDUCE_VALUE_SIZE];
+
+    if (loop->body == NULL)
+        memcpy(acc, loop->identity, loop->value_size);
+
+    while (begin < end) {
+        if (end - begin >= 2 * loop->grain && parallel_hungry(loop->pool)) {
+            size_t middle = begin + (end - begin) / 2;
+
+            /* Without a piece the thread simply runs on */
+            if (parallel_spawn(loop, middle, end) == 0) {
+                end = middle;
+                continue;
+            }
+        }
+
+        size_t stop = end - begin > loop->grain ? begin + loop->grain : end;
+
+        if (loop->body != NULL)
+            loop->body(begin, stop, loop->ctx);
+        else
+            loop->reduce(begin, stop, loop->ctx, acc);
+
+        begin = stop;
+    }
+
+    if (loop->body == NULL) {
+        pthread_mutex_lock(&loop->result_lock);
+        loop->combine(loop->result, acc, loop->ctx);
+        pthread_mutex_unlock(&loop->result_lock);
+    }
+}
+
+static void parallel_piece_run(void *arg, size_t argsz __attribute__ ((unused))) {
+    parallel_piece *piece = arg;
+    parallel_loop *loop = piece->loop;
+
+    parallel_run(loop, piece->begin, piece->end);
+    thread_pool_free(loop->pool, piece, sizeof(parallel_piece));
+
+    /* The caller may return as soon as it sees 0, only the address of pending is used then */
+    if (atomic_fetch_sub_explicit(&loop->pending, 1, memory_order_acq_rel) == 1)
+        futex_wake(&loop->pending, INT32_MAX);
+}
+
+/**
+ * Runs the loop on the calling thread, which the other threads help by
+ * taking the pieces it defers, and waits for the pieces. A pool thread
+ * runs other jobs meanwhile, as in future_get().
+ */
+static int parallel_loop_run(parallel_loop *loop, size_t begin, size_t end) {
+    thread_pool_t *pool = loop->pool;
+
+    if (loop->grain == 0) {
+        size_t threads = atomic_load_explicit(&pool->num_threads_alive, memory_order_relaxed);
+        size_t chunks = (threads > 0 ? threads : 1) * THREAD_POOL_PARALLEL_CHUNKS;
+
+        loop->grain = (end - begin) / chunks > 0 ? (end - begin) / chunks : 1;
+    }
+
+    atomic_init(&loop->pending, 0);
+
+    parallel_run(loop, begin, end);
+
+    uint32_t pending;
+
+    while ((pending = atomic_load_explicit(&loop->pending, memory_order_acquire)) != 0) {
+        int ran = thread_pool_help();
+
+        if (ran == 1)
+            continue;
+
+        struct timespec timeout = {.tv_sec = 0, .tv_nsec = PARALLEL_HELP_WAIT_NS};
+        futex_wait(&loop->pending, pending, ran == 0 ? &timeout : NULL);
+    }
+
+    return 0;
+}
+
+/**
+ * Calls fn for the indices begin to end - 1, in chunks of at least grain
+ * indices, which the threads of the pool and the calling thread run in
+ * parallel. The range is split lazily, only when another thread is ready
+ * to take a part of it, so the chunks adapt to the load and an idle pool
+ * runs few of them. Returns when every index is done.
+ * @param pool  - pointer on the thread_pool
+ * @param begin - first index
+ * @param end   - index after the last one
+ * @param grain - least number of indices in a chunk, 0 for a default
+ * @param fn    - function called for each chunk
+ * @param ctx   - argument passed to fn
+ * @return 0 on success, otherwise -1.
+ */
+int thread_pool_parallel_for(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                             parallel_for_fn fn, void *ctx) {
+    if (pool == NULL || fn == NULL) {
+        err("thread_pool_parallel_for(): pool or fn is a null pointer.\n");
+        return -1;
+    }
+
+    if (begin >= end)
+        return 0;
+
+    parallel_loop loop = {.pool = pool, .grain = grain, .body = fn, .ctx = ctx};
+
+    return parallel_loop_run(&loop, begin, end);
+}
+
+/**
+ * Reduces the indices begin to end - 1 in parallel, as thread_pool_parallel_for().
+ * Each part of the range is accumulated by fn into its own copy of the
+ * identity value, and the parts are combined into result in any order.
+ * @param pool       - pointer on the thread_pool
+ * @param begin      - first index
+ * @param end        - index after the last one
+ * @param grain      - least number of indices in a chunk, 0 for a default
+ * @param fn         - function accumulating a chunk into a value
+ * @param combine    - function combining two values, associative and commutative
+ * @param result     - holds the identity value of combine, gets the result
+ * @param value_size - size of the value, at most THREAD_POOL_REDUCE_VALUE_SIZE
+ * @param ctx        - argument passed to fn and combine
+ * @return 0 on success, otherwise -1.
+ */
+int thread_pool_parallel_reduce(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                                parallel_reduce_fn fn, parallel_combine_fn combine,
+                                void *result, size_t value_size, void *ctx) {
+    if (pool == NULL || fn == NULL || combine == NULL || result == NULL) {
+        err("thread_pool_parallel_reduce(): an argument is a null pointer.\n");
+        return -1;
+    }
+
+    if (value_size > THREAD_POOL_REDUCE_VALUE_SIZE) {
+        err("thread_pool_parallel_reduce(): value is too big.\n");
+        return -1;
+    }
+
+    if (begin >= end)
+        return 0;
+
+    parallel_loop loop = {.pool = pool, .grain = grain, .reduce = fn, .combine = combine,
+                          .ctx = ctx, .result = result, .value_size = value_size};
+
+    memcpy(loop.identity, result, value_size);
+    pthread_mutex_init(&loop.result_lock, NULL);
+
+    int ret = parallel_loop_run(&loop, begin, end);
+
+    pthread_mutex_destroy(&loop.result_lock);
+
+    return ret;
+}
+
+/* ================================================================== */
+
+/* ============================ JOB QUEUE =========================== */
+
+static int jobqueue_init(jobqueue *jobqueue_p, const thread_pool_options_t *options) {
+    atomic_init(&jobqueue_p->len, 0);
+    jobqueue_p->front = NULL;
+    jobqueue_p->rear = NULL;
+    jobqueue_p->ring = NULL;
+    eventcount_init(&jobqueue_p->not_full);
+    atomic_init(&jobqueue_p->blocked, 0);
+    atomic_init(&jobqueue_p->rejected, 0);
+    atomic_init(&jobqueue_p->caller_ran, 0);
+
+    if (pthread_mutex_init(&(jobqueue_p->r_w_mutex), 0) != 0) {
+        err("jobqueue_init(): mutex initialisation failed.\n");
+        return -1;
+    }
+
+    if (options->queue == THREAD_POOL_QUEUE_RING) {
+        jobqueue_p->ring = malloc(sizeof(struct ring));
+
+        if (jobqueue_p->ring == NULL) {
+            err("jobqueue_init(): Malloc failed for ring.\n");
+            pthread_mutex_destroy(&jobqueue_p->r_w_mutex);
+            return -1;
+        }
+
+        if (ring_init(jobqueue_p->ring, options->queue_capacity, sizeof(struct job)) == -1) {
+            err("jobqueue_init(): ring initialisation failed.\n");
+            free(jobqueue_p->ring);
+            jobqueue_p->ring = NULL;
+            pthread_mutex_destroy(&jobqueue_p->r_w_mutex);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void jobqueue_clear(thread_pool_t *pool, jobqueue *jobqueue_p) {
+    if (jobqueue_p->ring != NULL) {
+        job ring_job;
+
+        while (ring_pop(jobqueue_p->ring, &ring_job) == 0);
+    }
+
+    while (atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed)) {
+        thread_pool_free(pool, jobqueue_pull(jobqueue_p, NULL), sizeof(struct job));
+    }
+
+    jobqueue_p->front = NULL;
+    jobqueue_p->rear = NULL;
+    atomic_store_explicit(&jobqueue_p->len, 0, memory_order_relaxed);
+}
+
+/**
+ * Appends a chain of n jobs, linked from front to rear by prev pointers,
+ * at the rear of the job queue.
+ */
+static void jobqueue_push(jobqueue *jobqueue_p, job *front, job *rear, size_t n) {
+    rear->prev = NULL;
+
+    pthread_mutex_lock(&(jobqueue_p->r_w_mutex));
+
+    size_t len = atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed);
+
+    switch (len) {
+        case 0:
+            jobqueue_p->front = front;
+            jobqueue_p->rear = rear;
+            break;
+        default:
+            jobqueue_p->rear->prev = front;
+            jobqueue_p->rear = rear;
+    }
+
+    atomic_store_explicit(&jobqueue_p->len, len + n, memory_order_relaxed);
+
+    pthread_mutex_unlock(&jobqueue_p->r_w_mutex);
+}
+
+/* Copies n jobs into the ring at once, n is at most the capacity of the ring */
+static int ring_push_jobs(ring *ring_p, const job *jobs, size_t n) {
+    return n == 1 ? ring_push(ring_p, jobs) : ring_push_bulk(ring_p, jobs, n);
+}
+
+/* Reserves room for n jobs held by pointer, in a list or a deque, if the pool is bounded */
+static int pool_room_reserve(thread_pool_t *pool, size_t n) {
+    size_t room = atomic_load_explicit(&pool->room, memory_order_relaxed);
+
+    while (room >= n) {
+        if (atomic_compare_exchange_weak_explicit(&pool->room, &room, room - n,
+                                                  memory_order_acquire, memory_order_relaxed))
+            return 0;
+    }
+
+    return -1;
+}
+
+/* Takes the room of n jobs once, without waiting: copies them into the ring or reserves pool room */
+static int submit_try_room(thread_pool_t *pool, jobqueue *jobqueue_p, submit_room room, const job *jobs, size_t n) {
+    if (room == SUBMIT_ROOM_RING)
+        return ring_push_jobs(jobqueue_p->ring, jobs, n);
+
+    return pool_room_reserve(pool, n);
+}
+
+/**
+ * Gives back the room of n jobs, taken out of a list or a deque,
+ * or reserved and not pushed after all.
+ */
+static void pool_room_release(thread_pool_t *pool, size_t n) {
+    if (!pool->bounded)
+        return;
+
+    atomic_fetch_add_explicit(&pool->room, n, memory_order_release);
+    eventcount_notify(&pool->not_full, (int) n);
+}
+
+/* Policy on a full queue for the calling thread, a thread of the pool never waits for room */
+static thread_pool_full submit_policy(thread_pool_t *pool, int local) {
+    thread_pool_full on_full = pool->options.on_full;
+
+    if (local && on_full != THREAD_POOL_FULL_ERROR)
+        return THREAD_POOL_FULL_CALLER_RUNS;
+
+    return on_full;
+}
+
+/**
+ * Takes the room of n jobs, see submit_try_room(), and if there is none,
+ * behaves as on_full says, see submit_policy(). The counters of
+ * thread_pool_stats() are those of the queue.
+ * @param room    - where the jobs take room.
+ * @param jobs    - in SUBMIT_ROOM_RING, jobs to be copied into the ring, otherwise NULL.
+ * @param on_full - policy of the caller on a full queue.
+ * @return 0 on success, 1 if the caller is to run the jobs, -1 with errno
+ *         EAGAIN or ETIMEDOUT if the queue was full.
+ */
+static int submit_wait_room(thread_pool_t *pool, jobqueue *jobqueue_p, submit_room room, const job *jobs,
+                            size_t n, thread_pool_full on_full) {
+    eventcount *not_full = room == SUBMIT_ROOM_RING ? &jobqueue_p->not_full : &pool->not_full;
+
+    if (submit_try_room(pool, jobqueue_p, room, jobs, n) == 0)
+        return 0;
+
+    switch (on_full) {
+        case THREAD_POOL_FULL_ERROR:
+            atomic_fetch_add_explicit(&jobqueue_p->rejected, 1, memory_order_relaxed);
+            errno = EAGAIN;
+            return -1;
+        case THREAD_POOL_FULL_CALLER_RUNS:
+            atomic_fetch_add_explicit(&jobqueue_p->caller_ran, 1, memory_order_relaxed);
+            return 1;
+        case THREAD_POOL_FULL_SPIN:
+            atomic_fetch_add_explicit(&jobqueue_p->blocked, 1, memory_order_relaxed);
+
+            while (submit_try_room(pool, jobqueue_p, room, jobs, n) != 0) {
+                sched_yield();
+            }
+
+            return 0;
+        default:
+            break;
+    }
+
+    atomic_fetch_add_explicit(&jobqueue_p->blocked, 1, memory_order_relaxed);
+
+    int timed = on_full == THREAD_POOL_FULL_TIMEOUT;
+    uint64_t deadline = timed ? monotonic_ns() + pool->options.full_timeout_ns : 0;
+
+    for (;;) {
+        uint32_t key = eventcount_prepare_wait(not_full);
+
+        if (submit_try_room(pool, jobqueue_p, room, jobs, n) == 0) {
+            eventcount_cancel_wait(not_full);
+            return 0;
+        }
+
+        if (!timed) {
+            eventcount_wait(not_full, key);
+            continue;
+        }
+
+        uint64_t now = monotonic_ns();
+
+        if (now < deadline && eventcount_wait_timeout(not_full, key, deadline - now) == 0)
+            continue;
+
+        if (now >= deadline)
+            eventcount_cancel_wait(not_full);
+
+        /* Space freed right at the deadline is not missed */
+        if (submit_try_room(pool, jobqueue_p, room, jobs, n) == 0)
+            return 0;
+
+        atomic_fetch_add_explicit(&jobqueue_p->rejected, 1, memory_order_relaxed);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+}
+
+/**
+ * Copies n jobs into the ring of the job queue, at most its capacity.
+ * If there is no room for them, behaves as on_full says, see submit_wait_room().
+ */
+static int jobqueue_push_ring(thread_pool_t *pool, jobqueue *jobqueue_p, const job *jobs, size_t n,
+                              thread_pool_full on_full) {
+    return submit_wait_room(pool, jobqueue_p, SUBMIT_ROOM_RING, jobs, n, on_full);
+}
+
+/**
+ * Reserves room for n jobs held by pointer in a bounded pool, before they are
+ * linked into the queue or pushed to a deque. If there is none, behaves as
+ * on_full says, see submit_wait_room(). The jobs count in the stats of the queue.
+ */
+static int pool_room_take(thread_pool_t *pool, jobqueue *jobqueue_p, size_t n, thread_pool_full on_full) {
+    return submit_wait_room(pool, jobqueue_p, SUBMIT_ROOM_POOL, NULL, n, on_full);
+}
+
+/**
+ * Takes the front job of the job queue.
+ * @param jobqueue_p - pointer to the job queue.
+ * @param ring_job   - in ring mode, the job is copied here.
+ * @return pointer to the job, NULL if the queue was empty.
+ */
+static job *jobqueue_pull(jobqueue *jobqueue_p, job *ring_job) {
+    if (jobqueue_p->ring != NULL) {
+        if (ring_pop(jobqueue_p->ring, ring_job) != 0)
+            return NULL;
+
+        /* Producers blocked on a full ring wait for exactly this */
+        eventcount_notify(&jobqueue_p->not_full, 1);
+
+        return ring_job;
+    }
+
+    pthread_mutex_lock(&jobqueue_p->r_w_mutex);
+
+    job *job_p = jobqueue_p->front;
+
+    size_t len = atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed);
+
+    switch (len) {
+        case 0:
+            /* No jobs in the queue */
+            break;
+        case 1:
+            jobqueue_p->front = NULL;
+            jobqueue_p->rear = NULL;
+            atomic_store_explicit(&jobqueue_p->len, 0, memory_order_relaxed);
+            break;
+        default:
+            jobqueue_p->front = job_p->prev;
+            atomic_store_explicit(&jobqueue_p->len, len - 1, memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&jobqueue_p->r_w_mutex);
+
+    return job_p;
+}
+
+/* Approximate number of jobs in the job queue */
+static size_t jobqueue_len(jobqueue *jobqueue_p) {
+    if (jobqueue_p->ring != NULL)
+        return ring_size(jobqueue_p->ring);
+
+    /* Written under the mutex, read without it */
+    return atomic_load_explicit(&jobqueue_p->len, memory_order_relaxed);
+}
+
+/* Approximate number of jobs in the job queues of all the priority levels */
+static size_t jobqueues_len(thread_pool_t *pool) {
+    size_t len = 0;
+
+    for (size_t prio = 0; prio < THREAD_POOL_PRIORITIES; ++prio) {
+        len += jobqueue_len(&pool->jobqueue[prio]);
+    }
+
+    return len;
+}
+
+/* Destroys the job queues of the first levels, which are initialised */
+static void jobqueue_destroy(thread_pool_t *pool, size_t levels) {
+    for (size_t prio = 0; prio < levels; ++prio) {
+        jobqueue *jobqueue_p = &pool->jobqueue[prio];
+
+        jobqueue_clear(pool, jobqueue_p);
+
+        if (jobqueue_p->ring != NULL) {
+            ring_destroy(jobqueue_p->ring);
+            free(jobqueue_p->ring);
+        }
+
+        pthread_mutex_destroy(&jobqueue_p->r_w_mutex);
+    }
+}
+
+/* ================================================================== */
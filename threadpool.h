@@ -3,15 +3,127 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <sys/types.h>
+#include "deque.h"
+#include "ring.h"
+#include "park.h"
+#include "slab.h"
+#include "histogram.h"
+#include "timer.h"
+#include "topology.h"
 
 /**
  * Implementation of ThreadPool and Runnable with blocking queue.
+ * Tasks deferred from outside of the pool go to the shared job queue,
+ * tasks deferred by the pool's own threads go to their work-stealing deques.
  */
 
 #define err(str) fprintf(stderr, str)
 
+#define THREAD_POOL_RING_CAPACITY 4096
+
+/* Upper bound of rounds an idle thread looks for a job before it parks */
+#define THREAD_POOL_SPIN_ROUNDS 64
+
+/* Parking shorter than this means spinning a little longer would have found the job */
+#define THREAD_POOL_SPIN_PAYOFF_NS 50000
+
+/* Blocks of 64 and 128 bytes are recycled by the pool, bigger ones are malloc-ed */
+#define THREAD_POOL_SLAB_CLASSES 2
+#define THREAD_POOL_SLAB_MIN_BLOCK 64
+
+/* Default of metrics_sample, timing every job costs about as much as an empty job */
+#define THREAD_POOL_METRICS_SAMPLE 16
+
+/* Arguments up to this size are copied into the job in inline_args mode */
+#define THREAD_POOL_INLINE_ARG_SIZE 48
+
+/* Default of grow_wait_ns: a job waiting longer in an elastic pool starts a thread */
+#define THREAD_POOL_GROW_WAIT_NS 1000000
+
+/* Default of keep_alive_ns: a thread of an elastic pool idle for longer ends */
+#define THREAD_POOL_KEEP_ALIVE_NS 10000000000ull
+
+/* A thread takes its every n-th job from the lowest priority level which has one */
+#define THREAD_POOL_AGING_ROUNDS 16
+
+/* Resolution of defer_after() and defer_periodic() */
+#define THREAD_POOL_TIMER_TICK_NS 1000000
+
+/* Expired timers are deferred in batches of up to this many jobs */
+#define THREAD_POOL_TIMER_BATCH 64
+
+/* Default of full_timeout_ns */
+#define THREAD_POOL_FULL_TIMEOUT_NS 100000000
+
+/* Default grain of the parallel loops: about this many chunks of the range per thread */
+#define THREAD_POOL_PARALLEL_CHUNKS 16
+
+/* Largest value thread_pool_parallel_reduce() accumulates */
+#define THREAD_POOL_REDUCE_VALUE_SIZE 64
+
 /* ========================== STRUCTURES ============================ */
+typedef enum thread_pool_prio {
+    THREAD_POOL_PRIO_HIGH,   /* Run before any other queued job */
+    THREAD_POOL_PRIO_NORMAL, /* Priority of defer() */
+    THREAD_POOL_PRIO_LOW,    /* Run when nothing else is queued, or on aging */
+    THREAD_POOL_PRIORITIES
+} thread_pool_prio;
+
+typedef enum thread_pool_queue {
+    THREAD_POOL_QUEUE_LIST, /* Mutex protected linked list of jobs, unbounded */
+    THREAD_POOL_QUEUE_RING  /* Lock-free bounded ring, jobs stored by value */
+} thread_pool_queue;
+
+typedef enum thread_pool_full {
+    THREAD_POOL_FULL_BLOCK,      /* defer() sleeps until there is space */
+    THREAD_POOL_FULL_SPIN,       /* defer() spins until there is space */
+    THREAD_POOL_FULL_ERROR,      /* defer() returns -1 with errno set to EAGAIN */
+    THREAD_POOL_FULL_TIMEOUT,    /* As BLOCK for full_timeout_ns, then as ERROR with ETIMEDOUT */
+    THREAD_POOL_FULL_CALLER_RUNS /* defer() runs the job on the calling thread */
+} thread_pool_full;
+
+typedef enum thread_pool_pin {
+    THREAD_POOL_PIN_NONE, /* Threads run on any CPU, unless numa_node is set */
+    THREAD_POOL_PIN_CPU,  /* Each thread runs on a CPU of its own, as long as there are enough */
+    THREAD_POOL_PIN_NODE  /* Each thread runs on any CPU of its NUMA node */
+} thread_pool_pin;
+
+typedef struct thread_pool_options {
+    size_t num_threads;       /* Threads started with the pool, which never end before it */
+    size_t max_threads;       /* More than num_threads makes the pool elastic */
+    uint64_t grow_wait_ns;    /* Queue wait of a timed job which starts another thread */
+    uint64_t keep_alive_ns;   /* Idle time after which a thread above num_threads ends */
+    thread_pool_queue queue;  /* Kind of the shared job queue */
+    size_t queue_capacity;    /* Capacity of the ring, rounded up to a power of two */
+    size_t max_queued;        /* Jobs the lists and the deques hold together at most, 0 for no limit */
+    thread_pool_full on_full; /* Behaviour of defer() when the ring or the pool is full */
+    uint64_t full_timeout_ns; /* Longest wait for space with THREAD_POOL_FULL_TIMEOUT */
+    size_t prealloc;          /* Blocks of each size class allocated up front */
+    bool inline_args;         /* Copy small arguments into the job, see defer() */
+    unsigned int metrics_sample; /* Time every n-th job, 0 for none, see thread_pool_stats() */
+    thread_pool_pin pin;      /* Placement of the threads on the CPUs */
+    int numa_node;            /* Run the threads on this node only, -1 for every node */
+    size_t stack_size;        /* Stack size of the threads, 0 for the default */
+} thread_pool_options_t;
+
+typedef struct thread_pool_stats {
+    size_t slab_hits;           /* Allocations served with a recycled block */
+    size_t slab_misses;         /* Allocations which fell back to malloc */
+    size_t num_threads;         /* Threads running at the moment */
+    size_t num_threads_working; /* Threads running or looking for a job at the moment */
+    size_t queue_depth;         /* Jobs waiting in the shared queue and in the deques */
+    size_t submits_blocked;     /* Submissions which waited for space in a full queue */
+    size_t submits_rejected;    /* Submissions which failed on a full queue */
+    size_t submits_caller_ran;  /* Submissions run by the submitting thread on a full queue */
+    size_t tasks_executed;
+    size_t tasks_stolen;        /* Jobs taken from the deque of another thread */
+    uint64_t idle_ns;           /* Time the threads spent parked */
+    histogram queue_wait;       /* Nanoseconds from defer() to the start of the timed jobs */
+    histogram exec;             /* Nanoseconds the timed jobs ran */
+} thread_pool_stats_t;
+
 typedef struct runnable {
     void (*function)(void *, size_t);
 
@@ -19,47 +131,172 @@ typedef struct runnable {
     size_t argsz;
 } runnable_t;
 
-typedef struct bin_sem {
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    size_t v;
-} bsem;
-
 typedef struct job {
     struct job *prev; /* Pointer to the previous job */
     runnable_t job;
+    uint64_t submitted; /* Time of defer() if the job is timed, otherwise 0 */
+    bool inline_arg;  /* Argument of the job is the copy in args */
+    _Alignas(max_align_t) unsigned char args[THREAD_POOL_INLINE_ARG_SIZE];
 } job;
 
+/* Job waiting in the timer wheel, allocated from the slab of the pool */
+typedef struct scheduled_job {
+    timer timer;         /* First member, the wheel hands back the timer */
+    runnable_t runnable;
+    uint64_t period;     /* In ticks, 0 for a job run once */
+    _Alignas(max_align_t) unsigned char args[THREAD_POOL_INLINE_ARG_SIZE];
+} scheduled_job;
+
+/* Room a submission takes on a full queue, see submit_wait_room() */
+typedef enum submit_room {
+    SUBMIT_ROOM_RING, /* Places in the ring of a queue, the jobs are copied into them */
+    SUBMIT_ROOM_POOL  /* Room under max_queued, for jobs held by pointer in a list or a deque */
+} submit_room;
+
+/* How defer_batch() takes room for a batch */
+typedef enum batch_room {
+    BATCH_ROOM_WHOLE, /* All at once as on_full says, or none */
+    BATCH_ROOM_PARTS, /* In parts, as room frees, as on_full says */
+    BATCH_ROOM_TRY    /* In parts, only the room there is now, the stats do not count the rest */
+} batch_room;
+
 typedef struct jobqueue {
     pthread_mutex_t r_w_mutex; /* Mutex for read/write on queue */
     job *front;                /* Pointer to the front job in the queue */
     job *rear;                 /* Pointer to the rear job in the queue */
-    bsem *has_jobs;
-    size_t len;                /* Number of the jobs in the queue */
+    atomic_size_t len;         /* Number of the jobs in the queue */
+    ring *ring;                /* Used instead of the list in ring mode, otherwise NULL */
+    eventcount not_full;       /* Producers waiting for space in the ring */
+    atomic_size_t blocked;     /* Counters of thread_pool_stats() */
+    atomic_size_t rejected;
+    atomic_size_t caller_ran;
 } jobqueue;
 
+/* Written by the owner thread only, read by thread_pool_stats() */
+typedef struct thread_metrics {
+    CACHE_ALIGNED atomic_size_t executed;
+    atomic_size_t stolen;
+    _Atomic uint64_t idle_ns;
+    histogram queue_wait;
+    histogram exec;
+} thread_metrics;
+
 typedef struct thread {
     pthread_t pthread;                 /* Pointer to the actual thread */
     struct thread_pool *thread_pool_p; /* Ensures access to the thread pool */
+    size_t id;                         /* Index of the thread in the thread pool */
+    unsigned int seed;                 /* State for picking steal victims */
+    unsigned int spin;                 /* Rounds to look for a job before parking */
+    unsigned int aging;                /* Jobs looked for since the last aging round */
+    park_slot park;                    /* Where the thread sleeps when idle */
+    deque deque;                       /* Jobs deferred by this thread */
+    job ring_job;                      /* Job taken by value from the ring */
+    bool alive;                        /* A thread runs in the slot, protected by thcount_lock */
+    bool joinable;                     /* The thread of the slot was not joined yet */
+    bool pinned;                       /* The thread runs on the cpus only */
+    cpu_mask cpus;
+    size_t *victims;                   /* Other slots, nearest first, to steal from */
+    unsigned char *victim_distance;    /* Distance of the node of each victim */
+    thread_metrics metrics;
 } thread;
 
 typedef struct thread_pool {
     int id;
-    size_t keepAlive;
-    thread **threads;              /* Pointer to the threads in thread pool */
-    volatile size_t num_threads_alive;
-    volatile size_t num_threads_working;
-    jobqueue *jobqueue;
-    pthread_mutex_t thcount_lock;
+    atomic_size_t keepAlive;
+    thread **threads;              /* Slots for max_threads threads, some may not run */
+    size_t num_threads;            /* Number of the slots */
+    atomic_size_t num_threads_alive; /* Changed under thcount_lock */
+    atomic_size_t num_threads_working; /* Threads not parked, changed once per busy period */
+    jobqueue *jobqueue;            /* One queue per priority level */
+    park_lot idle;                 /* Idle threads park here, one is woken per job */
+    unsigned int spin_max;         /* 0 on a single CPU, where spinning never pays off */
+    atomic_size_t idle_waiters;    /* Threads waiting on threads_idle */
+    _Atomic uint64_t last_grow;    /* Time a thread was last started by the load */
+    pthread_mutex_t thcount_lock;  /* Protects threads_idle and starting and ending threads */
     pthread_cond_t threads_idle;
+    bool bounded;                  /* max_queued bounds the jobs of the lists and the deques */
+    atomic_size_t room;            /* Jobs they may still take, reserved before pushing */
+    eventcount not_full;           /* Producers waiting for room */
+    slab slabs[THREAD_POOL_SLAB_CLASSES]; /* Jobs, wrappers of futures and alike */
+    pthread_mutex_t timer_lock;    /* Protects the wheel and the fields below */
+    pthread_cond_t timer_cond;     /* Wakes the timer thread up for an earlier timer or to end */
+    timer_wheel wheel;
+    uint64_t timer_wake;           /* Tick the timer thread sleeps until, UINT64_MAX if no timer */
+    bool timer_started;            /* The timer thread is started with the first timer */
+    bool timer_stop;
+    pthread_t timer_thread;
+    atomic_size_t timers_pending;  /* Timers run once which were not deferred yet */
+    thread_pool_options_t options;
 } thread_pool_t;
 
+/* Body of thread_pool_parallel_for(), called for the indices begin to end - 1 */
+typedef void (*parallel_for_fn)(size_t begin, size_t end, void *ctx);
+
+/* Body of thread_pool_parallel_reduce(), accumulates the indices begin to end - 1 into acc */
+typedef void (*parallel_reduce_fn)(size_t begin, size_t end, void *ctx, void *acc);
+
+/* Combines the value other into acc, must be associative and commutative */
+typedef void (*parallel_combine_fn)(void *acc, const void *other, void *ctx);
+
+/* Shared by the pieces of a range of a parallel loop, lives on the stack of the caller */
+typedef struct parallel_loop {
+    thread_pool_t *pool;
+    size_t grain;                 /* Indices run between two looks at the load */
+    parallel_for_fn body;         /* NULL for a reduction */
+    parallel_reduce_fn reduce;
+    parallel_combine_fn combine;
+    void *ctx;
+    void *result;                 /* Value of the reduction, protected by result_lock */
+    size_t value_size;
+    pthread_mutex_t result_lock;
+    _Alignas(max_align_t) unsigned char identity[THREAD_POOL_REDUCE_VALUE_SIZE];
+    _Atomic uint32_t pending;     /* Pieces deferred and not done yet, the caller sleeps on it */
+} parallel_loop;
+
+/* Part of the range of a loop deferred for another thread to take */
+typedef struct parallel_piece {
+    parallel_loop *loop;
+    size_t begin;
+    size_t end;
+} parallel_piece;
+
 /* ================================================================== */
 
+void thread_pool_options_init(thread_pool_options_t *options, size_t num_threads);
+
 int thread_pool_init(thread_pool_t *pool, size_t pool_size);
 
+int thread_pool_init_ex(thread_pool_t *pool, const thread_pool_options_t *options);
+
 void thread_pool_destroy(thread_pool_t *pool);
 
 int defer(thread_pool_t *pool, runnable_t runnable);
 
+int defer_prio(thread_pool_t *pool, runnable_t runnable, thread_pool_prio prio);
+
+int defer_bulk(thread_pool_t *pool, runnable_t *runnables, size_t n);
+
+int defer_after(thread_pool_t *pool, runnable_t runnable, uint64_t delay_ns);
+
+int defer_periodic(thread_pool_t *pool, runnable_t runnable, uint64_t period_ns);
+
+int thread_pool_parallel_for(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                             parallel_for_fn fn, void *ctx);
+
+int thread_pool_parallel_reduce(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                                parallel_reduce_fn fn, parallel_combine_fn combine,
+                                void *result, size_t value_size, void *ctx);
+
+void *thread_pool_alloc(thread_pool_t *pool, size_t size);
+
+void thread_pool_free(thread_pool_t *pool, void *block, size_t size);
+
+void thread_pool_stats(thread_pool_t *pool, thread_pool_stats_t *stats);
+
+int thread_pool_help(void);
+
+int thread_pool_wait_idle(thread_pool_t *pool);
+
+int thread_pool_wait_idle_timeout(thread_pool_t *pool, uint64_t timeout_ns);
+
 #endif
@@ -0,0 +1,206 @@
+#include "timer.h"
+
+#define LEVEL_SPAN(level) ((uint64_t) 1 << (TIMER_WHEEL_BITS * (level)))
+
+#define SLOT(tick, level) (((tick) >> (TIMER_WHEEL_BITS * (level))) & (TIMER_WHEEL_SLOTS - 1))
+
+/**
+ * Initializes an empty wheel.
+ * @param wheel - pointer to the wheel.
+ * @param now   - current tick.
+ */
+void timer_wheel_init(timer_wheel *wheel, uint64_t now) {
+    wheel->now = now;
+
+    for (size_t level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        wheel->count[level] = 0;
+
+        for (size_t slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot) {
+            wheel->slots[level][slot] = NULL;
+        }
+    }
+}
+
+/**
+ * Puts the timer into the slot of the lowest level whose range covers it.
+ * Timers beyond the range of the wheel go to the last slot of the highest
+ * level, from where they cascade into the same slot again until they fit.
+ */
+static void timer_wheel_place(timer_wheel *wheel, timer *timer_p) {
+    uint64_t expires = timer_p->expires;
+    uint64_t delta = expires - wheel->now;
+    size_t level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= LEVEL_SPAN(level + 1))
+        ++level;
+
+    if (delta >= LEVEL_SPAN(TIMER_WHEEL_LEVELS))
+        expires = wheel->now + LEVEL_SPAN(TIMER_WHEEL_LEVELS) - 1;
+
+    timer **slot = &wheel->slots[level][SLOT(expires, level)];
+
+    timer_p->next = *slot;
+    *slot = timer_p;
+    wheel->count[level]++;
+}
+
+/* Moves the timers of a slot of a higher level to the lower ones */
+static void timer_wheel_cascade(timer_wheel *wheel, size_t level, size_t slot) {
+    timer *timer_p = wheel->slots[level][slot];
+
+    wheel->slots[level][slot] = NULL;
+
+    while (timer_p != NULL) {
+        timer *next = timer_p->next;
+
+        wheel->count[level]--;
+        timer_wheel_place(wheel, timer_p);
+        timer_p = next;
+    }
+}
+
+/**
+ * Adds a timer, whose expires is set. A timer which has expired already
+ * expires at the next tick.
+ * @param wheel   - pointer to the wheel.
+ * @param timer_p - pointer to the timer, owned by the wheel until it expires.
+ */
+void timer_wheel_add(timer_wheel *wheel, timer *timer_p) {
+    if (timer_p->expires <= wheel->now)
+        timer_p->expires = wheel->now + 1;
+
+    timer_wheel_place(wheel, timer_p);
+}
+
+/**
+ * Advances the wheel up to the tick now, skipping the ranges with no timers.
+ * @param wheel - pointer to the wheel.
+ * @param now   - current tick.
+ * @return list of the expired timers linked by next, in the order of their ticks,
+ *         or NULL if none expired.
+ */
+timer *timer_wheel_advance(timer_wheel *wheel, uint64_t now) {
+    timer *expired = NULL;
+    timer **tail = &expired;
+
+    while (wheel->now < now) {
+        size_t lowest = 0;
+
+        while (lowest < TIMER_WHEEL_LEVELS && wheel->count[lowest] == 0)
+            ++lowest;
+
+        if (lowest == TIMER_WHEEL_LEVELS) {
+            wheel->now = now;
+            break;
+        }
+
+        /* Nothing happens before the next cascade of the lowest level with timers */
+        if (lowest > 0) {
+            uint64_t skip = wheel->now | (LEVEL_SPAN(lowest) - 1);
+
+            if (skip >= now) {
+                wheel->now = now;
+                break;
+            }
+
+            wheel->now = skip;
+        }
+
+        uint64_t tick = ++wheel->now;
+        size_t top = 0;
+
+        while (top < TIMER_WHEEL_LEVELS - 1 && (tick & (LEVEL_SPAN(top + 1) - 1)) == 0)
+            ++top;
+
+        /* Higher levels first, their timers may fall into a slot cascaded next */
+        for (size_t level = top; level > 0; --level) {
+            timer_wheel_cascade(wheel, level, SLOT(tick, level));
+        }
+
+        timer *timer_p = wheel->slots[0][SLOT(tick, 0)];
+
+        wheel->slots[0][SLOT(tick, 0)] = NULL;
+
+        for (; timer_p != NULL; timer_p = timer_p->next) {
+            wheel->count[0]--;
+            *tail = timer_p;
+            tail = &timer_p->next;
+        }
+    }
+
+    *tail = NULL;
+
+    return expired;
+}
+
+/**
+ * Tick at which the wheel should be advanced next: the first tick with
+ * an expiring timer, or an earlier one on which timers cascade.
+ * @param wheel - pointer to the wheel.
+ * @return the tick, UINT64_MAX if the wheel is empty.
+ */
+uint64_t timer_wheel_next(const timer_wheel *wheel) {
+    uint64_t next = UINT64_MAX;
+
+    if (wheel->count[0] != 0) {
+        for (uint64_t tick = wheel->now + 1; tick <= wheel->now + TIMER_WHEEL_SLOTS; ++tick) {
+            if (wheel->slots[0][SLOT(tick, 0)] != NULL) {
+                next = tick;
+                break;
+            }
+        }
+    }
+
+    for (size_t level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        if (wheel->count[level] != 0) {
+            uint64_t cascade = (wheel->now | (LEVEL_SPAN(level) - 1)) + 1;
+
+            if (cascade < next)
+                next = cascade;
+
+            break;
+        }
+    }
+
+    return next;
+}
+
+/* Number of the timers in the wheel */
+size_t timer_wheel_size(const timer_wheel *wheel) {
+    size_t size = 0;
+
+    for (size_t level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        size += wheel->count[level];
+    }
+
+    return size;
+}
+
+/**
+ * Takes every timer out of the wheel, expired or not.
+ * @param wheel - pointer to the wheel.
+ * @return list of the timers linked by next, or NULL if the wheel was empty.
+ */
+timer *timer_wheel_clear(timer_wheel *wheel) {
+    timer *timers = NULL;
+
+    for (size_t level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        for (size_t slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot) {
+            timer *timer_p = wheel->slots[level][slot];
+
+            while (timer_p != NULL) {
+                timer *next = timer_p->next;
+
+                timer_p->next = timers;
+                timers = timer_p;
+                timer_p = next;
+            }
+
+            wheel->slots[level][slot] = NULL;
+        }
+
+        wheel->count[level] = 0;
+    }
+
+    return timers;
+}
@@ -0,0 +1,44 @@
+#ifndef ASYNC_TIMER_H
+#define ASYNC_TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Hierarchical timer wheel, in the manner of Varghese and Lauck.
+ * Time is counted in ticks. Level 0 has a slot for each of the next
+ * TIMER_WHEEL_SLOTS ticks, each higher level has a slot for a range
+ * TIMER_WHEEL_SLOTS times longer, whose timers cascade one level down
+ * when the wheel gets to the range. Adding a timer and taking an expired
+ * one costs O(1), whatever the number of timers. Not thread safe.
+ */
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/* Embedded by the users of the wheel, which get it back once it expires */
+typedef struct timer {
+    struct timer *next;
+    uint64_t expires; /* Tick at which the timer expires */
+} timer;
+
+typedef struct timer_wheel {
+    uint64_t now;     /* Last tick taken, timers expiring at it were taken too */
+    size_t count[TIMER_WHEEL_LEVELS];
+    timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel;
+
+void timer_wheel_init(timer_wheel *wheel, uint64_t now);
+
+void timer_wheel_add(timer_wheel *wheel, timer *timer_p);
+
+timer *timer_wheel_advance(timer_wheel *wheel, uint64_t now);
+
+uint64_t timer_wheel_next(const timer_wheel *wheel);
+
+size_t timer_wheel_size(const timer_wheel *wheel);
+
+timer *timer_wheel_clear(timer_wheel *wheel);
+
+#endif //ASYNC_TIMER_H
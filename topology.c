@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "topology.h"
+
+#define NODE_DIR "/sys/devices/system/node"
+
+void cpu_mask_zero(cpu_mask *mask) {
+    memset(mask->bits, 0, sizeof(mask->bits));
+}
+
+void cpu_mask_set(cpu_mask *mask, int cpu) {
+    if (cpu >= 0 && cpu < TOPOLOGY_MAX_CPUS)
+        mask->bits[cpu / 64] |= (uint64_t) 1 << (cpu % 64);
+}
+
+int cpu_mask_isset(const cpu_mask *mask, int cpu) {
+    if (cpu < 0 || cpu >= TOPOLOGY_MAX_CPUS)
+        return 0;
+
+    return (mask->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+/**
+ * Reads a list in the format of /sys, as "0-3,8,10-11", into the mask.
+ * @return 0 on success, -1 if the file could not be read.
+ */
+static int read_list(const char *path, cpu_mask *mask) {
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+        return -1;
+
+    char line[4096];
+    char *p = fgets(line, sizeof(line), file);
+
+    fclose(file);
+    cpu_mask_zero(mask);
+
+    if (p == NULL)
+        return -1;
+
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+
+        if (end == p)
+            return -1;
+
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+
+        for (long i = first; i <= last; ++i)
+            cpu_mask_set(mask, (int) i);
+
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return 0;
+}
+
+/* CPUs the calling thread may run on */
+static void allowed_cpus(cpu_mask *mask) {
+    cpu_mask_zero(mask);
+
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < TOPOLOGY_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set))
+                cpu_mask_set(mask, cpu);
+        }
+
+        return;
+    }
+#endif
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (long cpu = 0; cpu < cpus && cpu < TOPOLOGY_MAX_CPUS; ++cpu)
+        cpu_mask_set(mask, (int) cpu);
+}
+
+/* Reads the distances of the node to the online nodes, which the file lists in order */
+static void read_distances(topology *topo, int node, const cpu_mask *online) {
+    char path[128];
+    snprintf(path, sizeof(path), NODE_DIR "/node%d/distance", node);
+
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+        return;
+
+    for (int other = 0; other < TOPOLOGY_MAX_NODES; ++other) {
+        int distance;
+
+        if (!cpu_mask_isset(online, other))
+            continue;
+
+        if (fscanf(file, "%d", &distance) != 1)
+            break;
+
+        topo->distance[node][other] = (unsigned char) distance;
+    }
+
+    fclose(file);
+}
+
+/**
+ * Discovers the CPUs the process may run on and their NUMA nodes.
+ * @param topo - pointer to the topology to be filled.
+ * @return 0 on success, -1 if no CPU was found.
+ */
+int topology_discover(topology *topo) {
+    cpu_mask allowed, online, node_cpus;
+
+    allowed_cpus(&allowed);
+
+    topo->num_cpus = 0;
+    topo->num_nodes = 0;
+
+    /* Nodes unknown to /sys are as far from each other as it gets */
+    memset(topo->distance, 255, sizeof(topo->distance));
+
+    if (read_list(NODE_DIR "/online", &online) == 0) {
+        for (int node = 0; node < TOPOLOGY_MAX_NODES; ++node) {
+            char path[128];
+            snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", node);
+
+            if (!cpu_mask_isset(&online, node) || read_list(path, &node_cpus) == -1)
+                continue;
+
+            topo->num_nodes = (size_t) node + 1;
+            topo->distance[node][node] = TOPOLOGY_LOCAL_DISTANCE;
+            read_distances(topo, node, &online);
+
+            for (int cpu = 0; cpu < TOPOLOGY_MAX_CPUS; ++cpu) {
+                if (cpu_mask_isset(&node_cpus, cpu) && cpu_mask_isset(&allowed, cpu)) {
+                    topo->cpus[topo->num_cpus] = cpu;
+                    topo->cpu_node[topo->num_cpus] = node;
+                    topo->num_cpus++;
+                }
+            }
+        }
+    }
+
+    /* No NUMA information, a single node with every allowed CPU */
+    if (topo->num_cpus == 0) {
+        topo->num_nodes = 1;
+        topo->distance[0][0] = TOPOLOGY_LOCAL_DISTANCE;
+
+        for (int cpu = 0; cpu < TOPOLOGY_MAX_CPUS; ++cpu) {
+            if (cpu_mask_isset(&allowed, cpu)) {
+                topo->cpus[topo->num_cpus] = cpu;
+                topo->cpu_node[topo->num_cpus] = 0;
+                topo->num_cpus++;
+            }
+        }
+    }
+
+    if (topo->num_cpus == 0) {
+        fprintf(stderr, "topology_discover(): No CPU found.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Sets the CPU affinity of the threads created with the attributes.
+ * @return 0 on success, -1 if it failed or is not supported.
+ */
+int topology_attr_affinity(pthread_attr_t *attr, const cpu_mask *mask) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (int cpu = 0; cpu < TOPOLOGY_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu) {
+        if (cpu_mask_isset(mask, cpu))
+            CPU_SET(cpu, &set);
+    }
+
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0 ? 0 : -1;
+#else
+    (void) attr;
+    (void) mask;
+
+    return -1;
+#endif
+}
@@ -0,0 +1,42 @@
+#ifndef ASYNC_TOPOLOGY_H
+#define ASYNC_TOPOLOGY_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CPUs and NUMA nodes of the machine, as far as the process may use them.
+ * On Linux they are read from /sys/devices/system/node, elsewhere, or when
+ * /sys is not there, every CPU is taken to be on a single node.
+ */
+
+#define TOPOLOGY_MAX_CPUS 1024
+#define TOPOLOGY_MAX_NODES 64
+
+/* Distance of a node to itself, as in the ACPI SLIT */
+#define TOPOLOGY_LOCAL_DISTANCE 10
+
+typedef struct cpu_mask {
+    uint64_t bits[TOPOLOGY_MAX_CPUS / 64];
+} cpu_mask;
+
+typedef struct topology {
+    size_t num_cpus;
+    int cpus[TOPOLOGY_MAX_CPUS];      /* CPUs the process may run on, node by node */
+    int cpu_node[TOPOLOGY_MAX_CPUS];  /* Node of each of the cpus */
+    size_t num_nodes;                 /* Nodes are numbered as in /sys, some may have no CPU */
+    unsigned char distance[TOPOLOGY_MAX_NODES][TOPOLOGY_MAX_NODES];
+} topology;
+
+int topology_discover(topology *topo);
+
+void cpu_mask_zero(cpu_mask *mask);
+
+void cpu_mask_set(cpu_mask *mask, int cpu);
+
+int cpu_mask_isset(const cpu_mask *mask, int cpu);
+
+int topology_attr_affinity(pthread_attr_t *attr, const cpu_mask *mask);
+
+#endif //ASYNC_TOPOLOGY_H